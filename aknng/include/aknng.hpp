@@ -122,16 +122,25 @@ namespace aknng {
         }
 
         void save(const string& save_path) {
+            // binary
+            if (is_bin(save_path)) {
+                auto writer = GraphWriter(save_path, nodes.size());
+                for (const auto& node : nodes) {
+                    writer.add(node.neighbors.begin(), node.neighbors.end(),
+                               [](const pair<const double, int>& p) { return p.second; },
+                               [](const pair<const double, int>& p) { return p.first; });
+                }
+                writer.close();
+                return;
+            }
+
             // csv
             if (is_csv(save_path)) {
                 ofstream ofs(save_path);
-                string line;
                 for (const auto& node : nodes) {
                     for (const auto& neighbor_pair : node.neighbors) {
-                        line = to_string(node.data.id) + ',' +
-                               to_string(neighbor_pair.second) + ',' +
-                               to_string(neighbor_pair.first);
-                        ofs << line << endl;
+                        ofs << node.data.id << ',' << neighbor_pair.second << ','
+                            << to_string(neighbor_pair.first) << '\n';
                     }
                 }
                 return;
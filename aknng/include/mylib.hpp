@@ -13,6 +13,7 @@
 #include <exception>
 #include <stdexcept>
 #include <omp.h>
+#include <cstdint>
 #include <json.hpp>
 
 using namespace std;
@@ -244,6 +245,85 @@ namespace mylib {
         return (path.rfind(".csv", path.size()) < path.size());
     }
 
+    bool is_bin(const string& path) {
+        return (path.rfind(".bin", path.size()) < path.size());
+    }
+
+    // binary adjacency file:
+    // header, uint32 degree[n_node], uint32 neighbor[n_edge], (float dist[n_edge])
+    constexpr char graph_file_magic[8] = {'M', 'Y', 'G', 'R', 'A', 'P', 'H', '\0'};
+    constexpr uint32_t graph_file_version = 1;
+    constexpr uint32_t graph_file_has_dist = 1;
+    constexpr uint32_t graph_file_optimized = 2;
+
+    struct GraphFileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t flags;
+        uint64_t n_node;
+        uint64_t n_edge;
+        int64_t entry_id;   // navigating node (-1 if none)
+    };
+
+    // write adjacency lists node by node without holding them in memory
+    struct GraphWriter {
+        string path, dist_path;
+        ofstream ofs, dist_ofs;
+        GraphFileHeader header;
+        vector<uint32_t> degrees;
+
+        GraphWriter(const string& path, size_t n_node, uint32_t flags = graph_file_has_dist,
+                    int64_t entry_id = -1) : path(path), dist_path(path + ".dist"),
+                                             ofs(path, ios::binary) {
+            if (!ofs) throw runtime_error("Can't open file!: " + path);
+            copy(begin(graph_file_magic), end(graph_file_magic), header.magic);
+            header.version = graph_file_version;
+            header.flags = flags;
+            header.n_node = n_node;
+            header.n_edge = 0;
+            header.entry_id = entry_id;
+            degrees.reserve(n_node);
+
+            // neighbor ids follow the header and the degree array
+            ofs.seekp(sizeof(GraphFileHeader) + n_node * sizeof(uint32_t));
+            if (has_dist()) dist_ofs.open(dist_path, ios::binary);
+        }
+
+        bool has_dist() const { return header.flags & graph_file_has_dist; }
+
+        template <typename Iterator, typename GetId, typename GetDist>
+        void add(Iterator first, Iterator last, GetId get_id, GetDist get_dist) {
+            uint32_t degree = 0;
+            for (auto it = first; it != last; ++it, ++degree) {
+                const uint32_t id = get_id(*it);
+                ofs.write(reinterpret_cast<const char*>(&id), sizeof(id));
+                if (!has_dist()) continue;
+                const float dist = get_dist(*it);
+                dist_ofs.write(reinterpret_cast<const char*>(&dist), sizeof(dist));
+            }
+            degrees.emplace_back(degree);
+            header.n_edge += degree;
+        }
+
+        void close() {
+            if (degrees.size() != header.n_node) throw runtime_error("Invalid number of nodes!");
+
+            if (has_dist()) {
+                dist_ofs.close();
+                ifstream dist_ifs(dist_path, ios::binary);
+                ofs << dist_ifs.rdbuf();
+                dist_ifs.close();
+                remove(dist_path.c_str());
+            }
+
+            ofs.seekp(0);
+            ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            ofs.write(reinterpret_cast<const char*>(degrees.data()),
+                      degrees.size() * sizeof(uint32_t));
+            ofs.close();
+        }
+    };
+
     template <typename T>
     auto scan_knn_search(const Data<T>& query, int k, const Dataset<T> dataset,
                          string distance = "euclidean") {
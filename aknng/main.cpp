@@ -11,7 +11,21 @@ int main() {
 
     int degree = config["degree"], n = config["n"];
     AKNNG aknng(degree);
-    aknng.build(data_path, n);
+    auto dataset = load_data(data_path, n);
+
+    // graph for maximum inner product search by LGTM:
+    // x -> (x, sqrt(M^2 - |x|^2)) with M = max |x| (same transform as LGTM)
+    if (config.value("distance", "euclidean") == "inner_product") {
+        vector<float> sqr_norms;
+        for (const auto& data : dataset) {
+            sqr_norms.emplace_back(inner_product(data.x.begin(), data.x.end(), data.x.begin(), 0.0f));
+        }
+        const auto max_sqr_norm = *max_element(sqr_norms.begin(), sqr_norms.end());
+        for (size_t i = 0; i < dataset.size(); ++i) {
+            dataset[i].x.emplace_back(sqrt(max(0.0f, max_sqr_norm - sqr_norms[i])));
+        }
+    }
+    aknng.build(dataset);
 
     string save_path = config["save_path"];
     aknng.save(save_path);
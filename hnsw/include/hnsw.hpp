@@ -82,6 +82,7 @@ namespace hnsw {
 
         int enter_node_id;
         int enter_node_level;
+        int prefetch_distance = default_prefetch_distance;
         vector<Layer> layers;
         map<int, vector<int>> layer_map;
         Dataset<> dataset;
@@ -109,8 +110,8 @@ namespace hnsw {
         auto search_layer(const Data<>& query, int start_node_id, int ef, int l_c) {
             auto result = SearchResult();
 
-            vector<bool> visited(dataset.size());
-            visited[start_node_id] = true;
+            auto visited = get_visited(dataset.size(), ef * m_max_0);
+            visited->insert(start_node_id);
 
             priority_queue<Neighbor, vector<Neighbor>, CompGreater> candidates;
             priority_queue<Neighbor, vector<Neighbor>, CompLess> top_candidates;
@@ -121,18 +122,34 @@ namespace hnsw {
             candidates.emplace(dist_from_en, start_node_id);
             top_candidates.emplace(dist_from_en, start_node_id);
 
+            const auto& layer = layers[l_c];
+            const auto prefetch_node = [&](int id) {
+                visited->prefetch(id);
+                prefetch_data(layer[id].data);
+            };
+
             while (!candidates.empty()) {
                 const auto nearest_candidate = candidates.top();
                 const auto& nearest_candidate_node = layers[l_c][nearest_candidate.id];
+                prefetch(nearest_candidate_node.neighbors.data());
                 candidates.pop();
 
                 if (nearest_candidate.dist > top_candidates.top().dist) break;
 
                 ++result.n_hop;
 
-                for (const auto neighbor : nearest_candidate_node.neighbors) {
-                    if (visited[neighbor.id]) continue;
-                    visited[neighbor.id] = true;
+                const auto& neighbors = nearest_candidate_node.neighbors;
+                for (int i = 0; i < min(prefetch_distance, (int)neighbors.size()); ++i) {
+                    prefetch_node(neighbors[i].id);
+                }
+
+                for (int i = 0; i < neighbors.size(); ++i) {
+                    const auto& neighbor = neighbors[i];
+                    if (i + prefetch_distance < neighbors.size()) {
+                        prefetch_node(neighbors[i + prefetch_distance].id);
+                    }
+
+                    if (!visited->insert(neighbor.id)) continue;
 
                     const auto& neighbor_node = layers[l_c][neighbor.id];
                     const auto dist_from_neighbor =
@@ -165,20 +182,18 @@ namespace hnsw {
             priority_queue<Neighbor, vector<Neighbor>, CompGreater>
                     candidates, discarded_candidates;
 
-            vector<bool> added(dataset.size());
-            added[query.id] = true;
+            auto added = get_visited(dataset.size(), initial_candidates.size() * m_max_0);
+            added->insert(query.id);
 
             // init candidates
             for (const auto& candidate : initial_candidates) {
-                if (added[candidate.id]) continue;
-                added[candidate.id] = true;
+                if (!added->insert(candidate.id)) continue;
                 candidates.emplace(candidate);
             }
 
             if (extend_candidates) {
                 for (const auto& candidate : initial_candidates) {
-                    if (added[candidate.id]) continue;
-                    added[candidate.id] = true;
+                    if (!added->insert(candidate.id)) continue;
 
                     const auto& candidate_node = layer[candidate.id];
                     for (const auto& neighbor : candidate_node.neighbors) {
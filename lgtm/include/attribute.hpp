@@ -0,0 +1,177 @@
+//
+//
+
+#ifndef LGTM_ATTRIBUTE_HPP
+#define LGTM_ATTRIBUTE_HPP
+
+#include <map>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+#include <stdexcept>
+#include <mylib.hpp>
+
+using namespace std;
+using namespace mylib;
+
+namespace attribute {
+    // integer attributes of points in columns (categorical values are encoded as integers),
+    // value of point id is columns[c][id]
+    struct AttributeStore {
+        vector<string> names;
+        vector<vector<int>> columns;
+        vector<map<int, size_t>> value_counts;   // number of points of each value in each column
+
+        size_t size() const { return columns.empty() ? 0 : columns.front().size(); }
+
+        int column_id(const string& name) const {
+            const auto it = find(names.begin(), names.end(), name);
+            if (it == names.end()) throw runtime_error("invalid attribute: " + name);
+            return it - names.begin();
+        }
+
+        void add_column(const string& name, const vector<int>& values) {
+            if (!columns.empty() && values.size() != size()) throw runtime_error("Invalid number of values!");
+            names.emplace_back(name);
+            columns.emplace_back(values);
+            value_counts.emplace_back();
+            for (const auto value : values) ++value_counts.back()[value];
+        }
+
+        // add a point with a value for each column
+        void append(const vector<int>& values) {
+            if (values.size() != columns.size()) throw runtime_error("Invalid number of values!");
+            for (size_t c = 0; c < values.size(); ++c) {
+                columns[c].emplace_back(values[c]);
+                ++value_counts[c][values[c]];
+            }
+        }
+
+        // csv with a header of column names and a row for each of the first n points
+        void load(const string& path, int n) {
+            ifstream ifs(path);
+            if (!ifs) throw runtime_error("Can't open file!: " + path);
+
+            string line;
+            getline(ifs, line);
+            istringstream header(line);
+            for (string name; getline(header, name, ',');) names.emplace_back(name);
+            columns.assign(names.size(), vector<int>());
+            value_counts.assign(names.size(), map<int, size_t>());
+
+            for (int i = 0; i < n && getline(ifs, line); ++i) {
+                const auto row = split<double>(line);
+                if (row.size() != names.size()) throw runtime_error("Invalid attribute row: " + to_string(i));
+                for (size_t c = 0; c < row.size(); ++c) {
+                    columns[c].emplace_back(row[c]);
+                    ++value_counts[c][row[c]];
+                }
+            }
+        }
+
+        // relabel points: new point i is old point order[i]
+        void reorder(const vector<int>& order) {
+            for (auto& column : columns) {
+                vector<int> new_column(order.size());
+                for (size_t i = 0; i < order.size(); ++i) new_column[i] = column[order[i]];
+                column = move(new_column);
+            }
+        }
+    };
+
+    struct Condition {
+        enum Op { eq, ne, lt, le, gt, ge, in };
+
+        int column;
+        Op op;
+        vector<int> values;   // one value, or the set of "in"
+
+        static Op parse_op(const string& op) {
+            if (op == "==") return eq;
+            if (op == "!=") return ne;
+            if (op == "<") return lt;
+            if (op == "<=") return le;
+            if (op == ">") return gt;
+            if (op == ">=") return ge;
+            if (op == "in") return in;
+            throw runtime_error("invalid operator: " + op);
+        }
+
+        bool operator () (int value) const {
+            switch (op) {
+                case eq: return value == values[0];
+                case ne: return value != values[0];
+                case lt: return value < values[0];
+                case le: return value <= values[0];
+                case gt: return value > values[0];
+                case ge: return value >= values[0];
+                case in: return find(values.begin(), values.end(), value) != values.end();
+            }
+            return false;
+        }
+
+        // number of points matching from the value counts of the column
+        size_t count(const map<int, size_t>& value_counts, size_t n) const {
+            const auto sum = [&](map<int, size_t>::const_iterator first, map<int, size_t>::const_iterator last) {
+                size_t n_value = 0;
+                for (; first != last; ++first) n_value += first->second;
+                return n_value;
+            };
+            const auto count_of = [&](int value) {
+                const auto it = value_counts.find(value);
+                return it == value_counts.end() ? size_t(0) : it->second;
+            };
+
+            switch (op) {
+                case eq: return count_of(values[0]);
+                case ne: return n - count_of(values[0]);
+                case lt: return sum(value_counts.begin(), value_counts.lower_bound(values[0]));
+                case le: return sum(value_counts.begin(), value_counts.upper_bound(values[0]));
+                case gt: return sum(value_counts.upper_bound(values[0]), value_counts.end());
+                case ge: return sum(value_counts.lower_bound(values[0]), value_counts.end());
+                case in: {
+                    auto in_values = values;
+                    sort(in_values.begin(), in_values.end());
+                    in_values.erase(unique(in_values.begin(), in_values.end()), in_values.end());
+                    size_t n_value = 0;
+                    for (const auto value : in_values) n_value += count_of(value);
+                    return n_value;
+                }
+            }
+            return 0;
+        }
+    };
+
+    // conjunction of conditions on attributes of a point
+    struct Predicate {
+        const AttributeStore& store;
+        vector<Condition> conditions;
+        size_t n_match = 0;   // number of matching points (estimated for several conditions)
+
+        // n_match from the value counts: exact for a condition,
+        // the product of the selectivities of the conditions (as if independent) for several
+        Predicate(const AttributeStore& store, const vector<Condition>& conditions) :
+                store(store), conditions(conditions) {
+            const auto n = store.size();
+            double estimate = n;
+            for (const auto& condition : conditions) {
+                if (n == 0) break;
+                estimate *= static_cast<double>(condition.count(store.value_counts[condition.column], n)) / n;
+            }
+            n_match = static_cast<size_t>(estimate + 0.5);
+        }
+
+        bool operator () (size_t id) const {
+            for (const auto& condition : conditions) {
+                if (!condition(store.columns[condition.column][id])) return false;
+            }
+            return true;
+        }
+
+        double selectivity() const { return store.size() > 0 ? double(n_match) / store.size() : 0; }
+    };
+}
+
+#endif //LGTM_ATTRIBUTE_HPP
@@ -0,0 +1,158 @@
+//
+//
+
+#ifndef LGTM_COMPRESSION_HPP
+#define LGTM_COMPRESSION_HPP
+
+#include <vector>
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <x86intrin.h>
+
+using namespace std;
+
+namespace compression {
+    // group varint: a control byte (2 bits of byte length - 1 for each value)
+    // followed by 4 values of 1-4 bytes
+
+    // shuffle masks which expand 4 packed values into 4 uint32
+    struct ShuffleTable {
+        array<array<uint8_t, 16>, 256> masks;
+        array<uint8_t, 256> lengths;
+
+        ShuffleTable() {
+            for (int control = 0; control < 256; ++control) {
+                uint8_t pos = 0;
+                for (int i = 0; i < 4; ++i) {
+                    const int length = ((control >> (2 * i)) & 3) + 1;
+                    for (int j = 0; j < 4; ++j) {
+                        masks[control][i * 4 + j] = j < length ? pos + j : 0x80;
+                    }
+                    pos += length;
+                }
+                lengths[control] = pos;
+            }
+        }
+    };
+
+    const ShuffleTable& get_shuffle_table() {
+        static const ShuffleTable table;
+        return table;
+    }
+
+    int byte_length(uint32_t value) {
+        if (value < (1u << 8)) return 1;
+        if (value < (1u << 16)) return 2;
+        if (value < (1u << 24)) return 3;
+        return 4;
+    }
+
+    // encode sorted ids as deltas (count is padded to a multiple of 4 with zeros)
+    void encode_sorted(const vector<uint32_t>& ids, vector<uint8_t>& out) {
+        uint32_t prev = 0;
+        for (size_t i = 0; i < ids.size(); i += 4) {
+            const auto control_pos = out.size();
+            out.emplace_back(0);
+
+            uint8_t control = 0;
+            for (size_t j = 0; j < 4; ++j) {
+                const uint32_t delta = i + j < ids.size() ? ids[i + j] - prev : 0;
+                if (i + j < ids.size()) prev = ids[i + j];
+
+                const int length = byte_length(delta);
+                control |= (length - 1) << (2 * j);
+                for (int b = 0; b < length; ++b) out.emplace_back((delta >> (8 * b)) & 0xff);
+            }
+            out[control_pos] = control;
+        }
+    }
+
+    // decode count ids into out (out needs room for count rounded up to 4,
+    // in needs 16 readable bytes after the end of data)
+    void decode_sorted(const uint8_t* in, size_t count, uint32_t* out) {
+        const auto& table = get_shuffle_table();
+#ifdef __SSSE3__
+        __m128i prev = _mm_setzero_si128();
+        for (size_t i = 0; i < count; i += 4) {
+            const auto control = *in++;
+            const auto data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+            const auto mask = _mm_loadu_si128(
+                    reinterpret_cast<const __m128i*>(table.masks[control].data()));
+            auto values = _mm_shuffle_epi8(data, mask);
+
+            // prefix sum of deltas
+            values = _mm_add_epi32(values, _mm_slli_si128(values, 4));
+            values = _mm_add_epi32(values, _mm_slli_si128(values, 8));
+            values = _mm_add_epi32(values, prev);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), values);
+
+            prev = _mm_shuffle_epi32(values, 0xff);
+            in += table.lengths[control];
+        }
+#else
+        uint32_t prev = 0;
+        for (size_t i = 0; i < count; i += 4) {
+            const auto control = *in++;
+            for (int j = 0; j < 4; ++j) {
+                const int length = ((control >> (2 * j)) & 3) + 1;
+                uint32_t delta = 0;
+                for (int b = 0; b < length; ++b) delta |= uint32_t(*in++) << (8 * b);
+                prev += delta;
+                out[i + j] = prev;
+            }
+        }
+#endif
+    }
+
+    // adjacency lists of all nodes compressed with delta + group varint
+    struct CompressedGraph {
+        vector<uint64_t> offsets;
+        vector<uint32_t> degrees;
+        vector<uint8_t> bytes;
+        uint32_t max_degree = 0;
+
+        bool empty() const { return offsets.empty(); }
+        size_t memory_size() const {
+            return offsets.size() * sizeof(uint64_t) + degrees.size() * sizeof(uint32_t) + bytes.size();
+        }
+
+        // get_ids(i) returns neighbor ids of node i
+        template <typename GetIds>
+        void build(size_t n, GetIds get_ids) {
+            vector<vector<uint8_t>> encoded(n);
+            degrees.resize(n);
+
+#pragma omp parallel for schedule(dynamic, 1024)
+            for (int i = 0; i < static_cast<int>(n); ++i) {
+                auto ids = get_ids(i);
+                sort(ids.begin(), ids.end());
+                degrees[i] = ids.size();
+                encode_sorted(ids, encoded[i]);
+            }
+
+            offsets.assign(n + 1, 0);
+            for (size_t i = 0; i < n; ++i) {
+                offsets[i + 1] = offsets[i] + encoded[i].size();
+                max_degree = max(max_degree, degrees[i]);
+            }
+
+            // padding for 16 byte loads of decoder
+            bytes.resize(offsets[n] + 16);
+#pragma omp parallel for schedule(dynamic, 1024)
+            for (int i = 0; i < static_cast<int>(n); ++i) {
+                copy(encoded[i].begin(), encoded[i].end(), bytes.begin() + offsets[i]);
+            }
+        }
+
+        const uint8_t* address(size_t i) const { return bytes.data() + offsets[i]; }
+
+        // decode neighbor ids of node i into out (room for max_degree + 3 ids)
+        size_t decode(size_t i, uint32_t* out) const {
+            decode_sorted(address(i), degrees[i], out);
+            return degrees[i];
+        }
+    };
+}
+
+#endif //LGTM_COMPRESSION_HPP
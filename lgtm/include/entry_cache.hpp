@@ -0,0 +1,112 @@
+//
+//
+
+#ifndef LGTM_ENTRY_CACHE_HPP
+#define LGTM_ENTRY_CACHE_HPP
+
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <mylib.hpp>
+
+using namespace std;
+using namespace mylib;
+
+namespace entry_cache {
+    // result nodes of recent queries for each (table, bucket key),
+    // sharded with a lock per shard and CLOCK eviction in each shard
+    struct EntryCache {
+        struct Entry {
+            uint64_t key;
+            vector<int> ids;
+            bool referenced;
+        };
+
+        struct Shard {
+            mutex lock;
+            unordered_map<uint64_t, size_t> positions;
+            vector<Entry> entries;
+            size_t hand = 0;
+        };
+
+        size_t capacity_per_shard;
+        int n_id;   // nodes kept for each bucket
+        vector<Shard> shards;
+        atomic<unsigned long> n_hit{0}, n_miss{0};
+
+        EntryCache(size_t capacity, int n_id = 4, int n_shard = 64) :
+                capacity_per_shard(max<size_t>(1, (capacity + n_shard - 1) / n_shard)),
+                n_id(n_id), shards(n_shard) {}
+
+        static uint64_t make_key(int table_id, const vector<int>& bucket_key) {
+            // FNV-1a
+            uint64_t key = 14695981039346656037ull ^ static_cast<uint32_t>(table_id);
+            for (const auto e : bucket_key) {
+                key ^= static_cast<uint32_t>(e);
+                key *= 1099511628211ull;
+            }
+            return key;
+        }
+
+        Shard& shard_of(uint64_t key) { return shards[(key >> 32) % shards.size()]; }
+
+        // append cached ids of key to ids, return false if not cached
+        bool get(uint64_t key, vector<int>& ids) {
+            auto& shard = shard_of(key);
+            {
+                lock_guard<mutex> guard(shard.lock);
+                const auto it = shard.positions.find(key);
+                if (it != shard.positions.end()) {
+                    auto& entry = shard.entries[it->second];
+                    entry.referenced = true;
+                    ids.insert(ids.end(), entry.ids.begin(), entry.ids.end());
+                    n_hit.fetch_add(1, memory_order_relaxed);
+                    return true;
+                }
+            }
+            n_miss.fetch_add(1, memory_order_relaxed);
+            return false;
+        }
+
+        // keep the nearest n_id nodes of result (sorted) for key
+        void put(uint64_t key, const vector<Neighbor>& result) {
+            if (result.empty()) return;
+            auto& shard = shard_of(key);
+            lock_guard<mutex> guard(shard.lock);
+
+            const auto it = shard.positions.find(key);
+            size_t position;
+            if (it != shard.positions.end()) position = it->second;
+            else if (shard.entries.size() < capacity_per_shard) {
+                position = shard.entries.size();
+                shard.entries.emplace_back();
+                shard.positions.emplace(key, position);
+            } else {
+                // evict the first entry not referenced since the hand passed it
+                while (shard.entries[shard.hand].referenced) {
+                    shard.entries[shard.hand].referenced = false;
+                    shard.hand = (shard.hand + 1) % shard.entries.size();
+                }
+                position = shard.hand;
+                shard.hand = (shard.hand + 1) % shard.entries.size();
+                shard.positions.erase(shard.entries[position].key);
+                shard.positions.emplace(key, position);
+            }
+
+            auto& entry = shard.entries[position];
+            entry.key = key;
+            entry.referenced = true;
+            entry.ids.clear();
+            for (int i = 0; i < min<int>(n_id, result.size()); ++i) entry.ids.emplace_back(result[i].id);
+        }
+
+        double hit_rate() const {
+            const double n_lookup = n_hit + n_miss;
+            return n_lookup > 0 ? n_hit / n_lookup : 0;
+        }
+    };
+}
+
+#endif //LGTM_ENTRY_CACHE_HPP
@@ -0,0 +1,318 @@
+//
+//
+
+#ifndef LGTM_ENTRY_POINT_HPP
+#define LGTM_ENTRY_POINT_HPP
+
+#include <random>
+#include <memory>
+#include <unordered_set>
+#include <graph.hpp>
+#include <lsh.hpp>
+
+using namespace std;
+using namespace mylib;
+
+namespace entry_point {
+    using graph::EntryPointProvider;
+
+    // fixed start nodes (e.g. node 0 or a medoid)
+    struct FixedEntryPoints : EntryPointProvider {
+        vector<int> ids;
+
+        explicit FixedEntryPoints(const vector<int>& ids) : ids(ids) {}
+
+        string name() const override { return "fixed"; }
+
+        void get(const Data<>&, vector<int>& entry_ids) const override {
+            entry_ids.insert(entry_ids.end(), ids.begin(), ids.end());
+        }
+    };
+
+    // contents of the buckets which query falls in
+    struct LSHEntryPoints : EntryPointProvider {
+        const lsh::LSHIndex& lsh;
+
+        explicit LSHEntryPoints(const lsh::LSHIndex& lsh) : lsh(lsh) {}
+
+        string name() const override { return "lsh"; }
+
+        void get(const Data<>& query, vector<int>& entry_ids) const override {
+            const auto begin = entry_ids.size();
+            for (int i = 0; i < lsh.L; ++i) {
+                const auto bucket = lsh.find_bucket(query, i);
+                if (bucket) entry_ids.insert(entry_ids.end(), bucket->begin(), bucket->end());
+            }
+
+            // remove ids found in several tables
+            sort(entry_ids.begin() + begin, entry_ids.end());
+            entry_ids.erase(unique(entry_ids.begin() + begin, entry_ids.end()), entry_ids.end());
+        }
+    };
+
+    // nodes nearest to k-means centroids
+    struct KMeansEntryPoints : FixedEntryPoints {
+        KMeansEntryPoints(const graph::GraphIndex& graph, int n_cluster,
+                          int n_iter = 10, unsigned seed = 42) : FixedEntryPoints({}) {
+            const int n = graph.size();
+            if (n == 0) return;
+            n_cluster = min(n_cluster, n);
+            auto engine = mt19937(seed);
+
+            // cluster a sample of data
+            vector<int> sample(n);
+            iota(sample.begin(), sample.end(), 0);
+            shuffle(sample.begin(), sample.end(), engine);
+            sample.resize(min<size_t>(n, size_t(n_cluster) * 256));
+
+            Dataset<> centroids;
+            for (int i = 0; i < n_cluster; ++i) centroids.emplace_back(graph[sample[i]].data);
+
+            const auto dim = graph[0].data.size();
+            vector<int> assignments(sample.size());
+            for (int iter = 0; iter < n_iter; ++iter) {
+#pragma omp parallel for
+                for (size_t i = 0; i < sample.size(); ++i) {
+                    assignments[i] = nearest(graph[sample[i]].data, centroids, graph.calc_dist);
+                }
+
+                vector<vector<double>> sums(n_cluster, vector<double>(dim));
+                vector<int> counts(n_cluster);
+                for (size_t i = 0; i < sample.size(); ++i) {
+                    const auto& data = graph[sample[i]].data;
+                    auto& sum = sums[assignments[i]];
+                    for (size_t j = 0; j < dim; ++j) sum[j] += data[j];
+                    ++counts[assignments[i]];
+                }
+
+                // an empty cluster keeps its centroid
+                for (int c = 0; c < n_cluster; ++c) {
+                    if (counts[c] == 0) continue;
+                    for (size_t j = 0; j < dim; ++j) centroids[c][j] = sums[c][j] / counts[c];
+                }
+            }
+
+            // replace centroids with their nearest nodes
+            ids.resize(n_cluster);
+#pragma omp parallel for
+            for (int c = 0; c < n_cluster; ++c) {
+                auto nearest_dist = float_max;
+                for (const auto& node : graph) {
+                    const float dist = graph.calc_dist(centroids[c], node.data);
+                    if (dist >= nearest_dist) continue;
+                    nearest_dist = dist;
+                    ids[c] = node.data.id;
+                }
+            }
+            sort(ids.begin(), ids.end());
+            ids.erase(unique(ids.begin(), ids.end()), ids.end());
+        }
+
+        string name() const override { return "kmeans"; }
+
+        static int nearest(const Data<>& data, const Dataset<>& points, const DistanceFunction<>& calc_dist) {
+            int nearest_i = 0;
+            auto nearest_dist = float_max;
+            for (size_t i = 0; i < points.size(); ++i) {
+                const float dist = calc_dist(data, points[i]);
+                if (dist >= nearest_dist) continue;
+                nearest_dist = dist;
+                nearest_i = i;
+            }
+            return nearest_i;
+        }
+    };
+
+    // nodes with the largest in-degree
+    struct HubEntryPoints : FixedEntryPoints {
+        HubEntryPoints(const graph::GraphIndex& graph, int n_hub) : FixedEntryPoints({}) {
+            // adjacency lists are read through the graph, which may be compressed
+            vector<int> in_degrees(graph.size());
+            graph.with_adjacency([&](const auto& adjacency) {
+                for (size_t id = 0; id < graph.size(); ++id) {
+                    const auto neighbors = adjacency.get(id);
+                    const int n_neighbor = neighbors.size();
+                    for (int i = 0; i < n_neighbor; ++i) ++in_degrees[neighbors[i]];
+                }
+            });
+
+            ids.resize(graph.size());
+            iota(ids.begin(), ids.end(), 0);
+            n_hub = min(n_hub, static_cast<int>(ids.size()));
+            partial_sort(ids.begin(), ids.begin() + n_hub, ids.end(),
+                         [&](int i, int j) { return in_degrees[i] > in_degrees[j]; });
+            ids.resize(n_hub);
+        }
+
+        string name() const override { return "hub"; }
+    };
+
+    // random nodes drawn for each query
+    struct RandomEntryPoints : EntryPointProvider {
+        int n, n_sample;
+        unsigned seed;
+
+        RandomEntryPoints(int n, int n_sample, unsigned seed = 42) : n(n), n_sample(n_sample), seed(seed) {}
+
+        string name() const override { return "random"; }
+
+        void get(const Data<>&, vector<int>& entry_ids) const override {
+            static thread_local auto engine = mt19937(seed);
+            auto dist = uniform_int_distribution<int>(0, n - 1);
+            for (int i = 0; i < n_sample; ++i) entry_ids.emplace_back(dist(engine));
+        }
+    };
+
+    // greedy descent on sampled upper layers (HNSW style)
+    // layer l holds the first n / ratio^(l + 1) nodes of a shuffled order,
+    // so a position in a layer is the same position in the lower layer
+    struct LayeredEntryPoints : EntryPointProvider {
+        const graph::GraphIndex& graph;
+        const bool euclidean;
+        vector<int> order;                      // shuffled node ids
+        vector<int> layer_sizes;                // from the lowest layer
+        vector<vector<vector<int>>> neighbors;  // positions of neighbors in each layer
+
+        // layers up to this size are exact knn graphs, larger ones are built by greedy insertion
+        static constexpr int max_exact_size = 2048;
+
+        LayeredEntryPoints(const graph::GraphIndex& graph, int ratio = 32, int degree = 16,
+                           unsigned seed = 42, int ef = 64)
+                : graph(graph), euclidean(graph.distance_type == "euclidean") {
+            const int n = graph.size();
+            order.resize(n);
+            iota(order.begin(), order.end(), 0);
+            shuffle(order.begin(), order.end(), mt19937(seed));
+
+            for (int size = n / ratio; size > 0; size /= ratio) layer_sizes.emplace_back(size);
+
+            // from the top layer, as insertion descends the layers above
+            neighbors.resize(layer_sizes.size());
+            for (int l = layer_sizes.size() - 1; l >= 0; --l) {
+                if (layer_sizes[l] <= max_exact_size) build_exact(l, degree);
+                else build_greedy(l, degree, ef);
+            }
+        }
+
+        string name() const override { return "layered"; }
+
+        void get(const Data<>& query, vector<int>& entry_ids) const override {
+            if (layer_sizes.empty()) return;
+            entry_ids.emplace_back(order[descend(query, 0).id]);
+        }
+
+        float dist(const Data<>& query, int position) const {
+            const auto& data = graph[order[position]].data;
+            return euclidean ? EuclideanMetric()(query, data) : graph.calc_dist(query, data);
+        }
+
+        // nearest position by moving to nearer neighbors from the top layer down to layer lowest
+        Neighbor descend(const Data<>& query, int lowest) const {
+            auto nearest = Neighbor(dist(query, 0), 0);
+            for (int l = layer_sizes.size() - 1; l >= lowest; --l) {
+                for (bool moved = true; moved;) {
+                    moved = false;
+                    for (const auto neighbor : neighbors[l][nearest.id]) {
+                        const float neighbor_dist = dist(query, neighbor);
+                        if (neighbor_dist >= nearest.dist) continue;
+                        nearest = Neighbor(neighbor_dist, neighbor);
+                        moved = true;
+                    }
+                }
+            }
+            return nearest;
+        }
+
+        void build_exact(int l, int degree) {
+            const int size = layer_sizes[l];
+            auto& layer = neighbors[l];
+            layer.resize(size);
+#pragma omp parallel for schedule(dynamic, 64)
+            for (int i = 0; i < size; ++i) {
+                const auto& data = graph[order[i]].data;
+                Neighbors candidates;
+                for (int j = 0; j < size; ++j) {
+                    if (j != i) candidates.emplace_back(dist(data, j), j);
+                }
+                const int n_neighbor = min(degree, static_cast<int>(candidates.size()));
+                partial_sort(candidates.begin(), candidates.begin() + n_neighbor, candidates.end(), CompLess());
+                for (int j = 0; j < n_neighbor; ++j) layer[i].emplace_back(candidates[j].id);
+            }
+        }
+
+        // insert positions in order: search the inserted ones from the descent of the layers above,
+        // link the nearest degree and keep the nearest degree of each linked list
+        void build_greedy(int l, int degree, int ef) {
+            const int size = layer_sizes[l];
+            auto& layer = neighbors[l];
+            layer.resize(size);
+            for (int i = 1; i < size; ++i) {
+                const auto& data = graph[order[i]].data;
+                // an entry of the layers above may not be inserted in this layer yet
+                auto entry = l + 1 < static_cast<int>(layer_sizes.size()) ? descend(data, l + 1) :
+                             Neighbor(dist(data, 0), 0);
+                if (entry.id >= i) entry = Neighbor(dist(data, 0), 0);
+
+                const auto candidates = search_layer(data, layer, entry, ef);
+                const int n_neighbor = min(degree, static_cast<int>(candidates.size()));
+                for (int j = 0; j < n_neighbor; ++j) {
+                    const int neighbor = candidates[j].id;
+                    layer[i].emplace_back(neighbor);
+                    layer[neighbor].emplace_back(i);
+                    if (static_cast<int>(layer[neighbor].size()) > degree) prune(layer[neighbor], neighbor, degree);
+                }
+            }
+        }
+
+        // nearest ef positions by best-first search (nearest first)
+        Neighbors search_layer(const Data<>& query, const vector<vector<int>>& layer,
+                               const Neighbor& entry, size_t ef) const {
+            unordered_set<int> visited = {entry.id};
+            priority_queue<Neighbor, Neighbors, CompGreater> candidates;
+            priority_queue<Neighbor, Neighbors, CompLess> top_candidates;
+            candidates.emplace(entry);
+            top_candidates.emplace(entry);
+            while (!candidates.empty()) {
+                const auto nearest = candidates.top();
+                if (nearest.dist > top_candidates.top().dist) break;
+                candidates.pop();
+                for (const auto neighbor : layer[nearest.id]) {
+                    if (!visited.insert(neighbor).second) continue;
+                    const float neighbor_dist = dist(query, neighbor);
+                    if (top_candidates.size() >= ef && neighbor_dist >= top_candidates.top().dist) continue;
+                    candidates.emplace(neighbor_dist, neighbor);
+                    top_candidates.emplace(neighbor_dist, neighbor);
+                    if (top_candidates.size() > ef) top_candidates.pop();
+                }
+            }
+
+            Neighbors result;
+            for (; !top_candidates.empty(); top_candidates.pop()) result.emplace_back(top_candidates.top());
+            reverse(result.begin(), result.end());
+            return result;
+        }
+
+        void prune(vector<int>& positions, int position, int degree) const {
+            const auto& data = graph[order[position]].data;
+            Neighbors candidates;
+            for (const auto neighbor : positions) candidates.emplace_back(dist(data, neighbor), neighbor);
+            partial_sort(candidates.begin(), candidates.begin() + degree, candidates.end(), CompLess());
+            positions.resize(degree);
+            for (int j = 0; j < degree; ++j) positions[j] = candidates[j].id;
+        }
+    };
+
+    // n_entry: number of centroids, hubs or random nodes
+    unique_ptr<EntryPointProvider> make_entry_point_provider(const string& name,
+            const graph::GraphIndex& graph, const lsh::LSHIndex& lsh, int n_entry, unsigned seed = 42) {
+        if (name == "fixed") return unique_ptr<EntryPointProvider>(new FixedEntryPoints({0}));
+        if (name == "lsh") return unique_ptr<EntryPointProvider>(new LSHEntryPoints(lsh));
+        if (name == "kmeans") return unique_ptr<EntryPointProvider>(new KMeansEntryPoints(graph, n_entry, 10, seed));
+        if (name == "hub") return unique_ptr<EntryPointProvider>(new HubEntryPoints(graph, n_entry));
+        if (name == "random") return unique_ptr<EntryPointProvider>(new RandomEntryPoints(graph.size(), n_entry, seed));
+        if (name == "layered") return unique_ptr<EntryPointProvider>(new LayeredEntryPoints(graph, 32, 16, seed));
+        throw runtime_error("invalid entry point provider: " + name);
+    }
+}
+
+#endif //LGTM_ENTRY_POINT_HPP
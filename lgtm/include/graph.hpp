@@ -5,7 +5,12 @@
 #define mylib_GRAPH_HPP
 
 #include <queue>
+#include <atomic>
+#include <array>
+#include <mutex>
+#include <thread>
 #include <mylib.hpp>
+#include <compression.hpp>
 
 using namespace std;
 using namespace mylib;
@@ -42,17 +47,591 @@ namespace graph {
         unsigned long n_dist_calc = 0;
         unsigned long n_hop = 0;
         double dist_from_start = 0;
+        bool incomplete = false;   // stopped by the search budget
+    };
+
+    // neighbor ids read from Node::neighbors
+    struct NodeAdjacency {
+        const vector<Node>& nodes;
+
+        struct List {
+            const Neighbor* neighbors;
+            int n;
+            int size() const { return n; }
+            int operator [] (int i) const { return neighbors[i].id; }
+        };
+
+        List get(int id) const {
+            const auto& neighbors = nodes[id].neighbors;
+            return List{neighbors.data(), static_cast<int>(neighbors.size())};
+        }
+
+        void prefetch(int id) const { mylib::prefetch(nodes[id].neighbors.data()); }
+    };
+
+    // neighbor ids decoded from compressed adjacency lists
+    struct CompressedAdjacency {
+        const compression::CompressedGraph& graph;
+
+        struct List {
+            const uint32_t* ids;
+            int n;
+            int size() const { return n; }
+            int operator [] (int i) const { return ids[i]; }
+        };
+
+        // the list is valid until the next call in the same thread
+        List get(int id) const {
+            static thread_local vector<uint32_t> buffer;
+            if (buffer.size() < graph.max_degree + 4) buffer.resize(graph.max_degree + 4);
+            return List{buffer.data(), static_cast<int>(graph.decode(id, buffer.data()))};
+        }
+
+        void prefetch(int id) const { mylib::prefetch(graph.address(id)); }
+    };
+
+    // striped locks of adjacency lists, for inserting nodes while searching.
+    // searches read lists without locks unless an insertion is in flight:
+    // a search counts itself in n_unlocked_search before it checks n_inserting,
+    // an insertion counts itself in n_inserting before it waits for n_unlocked_search to drain
+    struct NodeLocks {
+        vector<mutex> stripes;
+        mutex append;   // adding a node
+        atomic<size_t> n_node{0};   // nodes visible to searches (see GraphIndex::size)
+        atomic<int> n_inserting{0}, n_unlocked_search{0};
+
+        explicit NodeLocks(size_t n_stripe = 4096) : stripes(n_stripe) {}
+
+        mutex& of(int id) { return stripes[id % stripes.size()]; }
+    };
+
+    // a search, which reads lists without locks if no insertion is in flight
+    struct SearchScope {
+        NodeLocks& locks;
+        bool unlocked;
+
+        explicit SearchScope(NodeLocks& locks) : locks(locks) {
+            ++locks.n_unlocked_search;
+            unlocked = locks.n_inserting == 0;
+            if (!unlocked) --locks.n_unlocked_search;
+        }
+
+        ~SearchScope() { if (unlocked) --locks.n_unlocked_search; }
+    };
+
+    // an insertion in flight: later searches take the locks, earlier ones without locks are waited for
+    struct InsertionScope {
+        NodeLocks& locks;
+
+        explicit InsertionScope(NodeLocks& locks) : locks(locks) {
+            ++locks.n_inserting;
+            while (locks.n_unlocked_search > 0) this_thread::yield();
+        }
+
+        ~InsertionScope() { --locks.n_inserting; }
+    };
+
+    // neighbor ids copied from Node::neighbors under the lock of the node
+    struct LockedNodeAdjacency {
+        const vector<Node>& nodes;
+        NodeLocks& locks;
+
+        struct List {
+            const int* ids;
+            int n;
+            int size() const { return n; }
+            int operator [] (int i) const { return ids[i]; }
+        };
+
+        // the list is valid until the next call in the same thread
+        List get(int id) const {
+            static thread_local vector<int> buffer;
+            lock_guard<mutex> guard(locks.of(id));
+            const auto& neighbors = nodes[id].neighbors;
+            buffer.resize(neighbors.size());
+            for (size_t i = 0; i < neighbors.size(); ++i) buffer[i] = neighbors[i].id;
+            return List{buffer.data(), static_cast<int>(buffer.size())};
+        }
+
+        // the list is prefetched only if its lock is free (it may be reallocated under the lock)
+        void prefetch(int id) const {
+            unique_lock<mutex> guard(locks.of(id), try_to_lock);
+            if (guard) mylib::prefetch(nodes[id].neighbors.data());
+        }
+    };
+
+    // search statistics (counters are compiled away if Enabled is false)
+    template <bool Enabled>
+    struct SearchStats {
+        unsigned long n_node_access = 0;
+        unsigned long n_dist_calc = 0;
+        unsigned long n_hop = 0;
+
+        void node_access() { ++n_node_access; }
+        void dist_calc() { ++n_dist_calc; }
+        void hop() { ++n_hop; }
+
+        void write(SearchResult& result) const {
+            result.n_node_access = n_node_access;
+            result.n_dist_calc = n_dist_calc;
+            result.n_hop = n_hop;
+        }
+    };
+
+    template <>
+    struct SearchStats<false> {
+        void node_access() {}
+        void dist_calc() {}
+        void hop() {}
+        void write(SearchResult&) const {}
+    };
+
+#ifndef GRAPH_COLLECT_STATS
+#define GRAPH_COLLECT_STATS 1
+#endif
+    constexpr bool collect_stats = GRAPH_COLLECT_STATS;
+
+    // limits of work of a search (0: unlimited)
+    struct SearchBudget {
+        unsigned long max_hop = 0;
+        unsigned long max_dist_calc = 0;
+        time_t max_time = 0;   // [microsec] from start_time
+        chrono::system_clock::time_point start_time;   // start of search if not set
+
+        bool limited() const { return max_hop > 0 || max_dist_calc > 0 || max_time > 0; }
+    };
+
+    // work of a search counted against a budget
+    struct BudgetCounter {
+        unsigned long max_hop, max_dist_calc;
+        bool has_deadline;
+        chrono::system_clock::time_point deadline;
+        unsigned long n_hop = 0, n_dist_calc = 0;
+
+        explicit BudgetCounter(const SearchBudget& budget) :
+                max_hop(budget.max_hop), max_dist_calc(budget.max_dist_calc),
+                has_deadline(budget.max_time > 0),
+                deadline((budget.start_time == chrono::system_clock::time_point() ?
+                          get_now() : budget.start_time) + chrono::microseconds(budget.max_time)) {}
+
+        void hop() { ++n_hop; }
+        void dist_calc() { ++n_dist_calc; }
+
+        // the clock is read every 8 hops
+        bool exhausted() const {
+            if (max_hop > 0 && n_hop >= max_hop) return true;
+            if (max_dist_calc > 0 && n_dist_calc >= max_dist_calc) return true;
+            return has_deadline && (n_hop & 7) == 0 && get_now() >= deadline;
+        }
+    };
+
+    struct Unlimited {
+        void hop() {}
+        void dist_calc() {}
+        bool exhausted() const { return false; }
+    };
+
+    // best-first search with a candidate heap and a top-ef heap (HNSW style)
+    struct HeapQueue {
+        priority_queue<Neighbor, vector<Neighbor>, CompGreater> candidates;
+        priority_queue<Neighbor, vector<Neighbor>, CompLess> top_candidates;
+        size_t ef, k;
+        // if bounded, stop when the nearest candidate is farther than top-ef
+        // and keep only candidates that enter top-ef
+        bool bounded;
+
+        HeapQueue(size_t ef, size_t k, bool bounded = true) : ef(ef), k(k), bounded(bounded) {}
+
+        float bound() const {
+            return top_candidates.size() < ef ? float_max : top_candidates.top().dist;
+        }
+
+        // id of the candidate expanded next (-1 if none)
+        int peek() const { return candidates.empty() ? -1 : candidates.top().id; }
+
+        // take the nearest candidate, return false if converged
+        bool pop(Neighbor& candidate) {
+            if (candidates.empty()) return false;
+            candidate = candidates.top();
+            candidates.pop();
+            return !(bounded && candidate.dist > top_candidates.top().dist);
+        }
+
+        // return true if the neighbor enters top-ef
+        bool push(const Neighbor& neighbor) {
+            if (neighbor.dist < bound()) {
+                candidates.emplace(neighbor);
+                top_candidates.emplace(neighbor);
+                if (top_candidates.size() > ef) top_candidates.pop();
+                return true;
+            }
+            if (!bounded) candidates.emplace(neighbor);
+            return false;
+        }
+
+        void get_result(vector<Neighbor>& result) {
+            while (!top_candidates.empty()) {
+                result.emplace_back(top_candidates.top());
+                top_candidates.pop();
+            }
+            reverse(result.begin(), result.end());
+            if (result.size() > k) result.resize(k);
+        }
+    };
+
+    // HeapQueue which admits only nodes matching filter into top-ef,
+    // other nodes are traversed while nearer than top-ef
+    // (the search runs until top-ef is full of matching nodes or candidates run out)
+    template <typename Filter>
+    struct FilteredHeapQueue : HeapQueue {
+        const Filter& filter;
+
+        FilteredHeapQueue(size_t ef, size_t k, const Filter& filter) : HeapQueue(ef, k), filter(filter) {}
+
+        bool pop(Neighbor& candidate) {
+            if (candidates.empty()) return false;
+            candidate = candidates.top();
+            candidates.pop();
+            return candidate.dist <= bound();
+        }
+
+        bool push(const Neighbor& neighbor) {
+            if (neighbor.dist >= bound()) return false;
+            candidates.emplace(neighbor);
+            if (!filter(neighbor.id)) return false;
+
+            top_candidates.emplace(neighbor);
+            if (top_candidates.size() > ef) top_candidates.pop();
+            return true;
+        }
+    };
+
+    // search with a sorted candidate pool of size l (NSG style)
+    struct PoolQueue {
+        CandidatePool pool;
+        size_t k;
+
+        PoolQueue(size_t l, size_t k) : pool(l), k(k) {}
+
+        float bound() const { return pool.full() ? pool.back().dist : float_max; }
+
+        int peek() {
+            const auto i = pool.next_unchecked();
+            return i < pool.size() ? pool[i].id : -1;
+        }
+
+        // take the nearest unchecked candidate, return false if all are checked
+        bool pop(Neighbor& candidate) {
+            const auto i = pool.next_unchecked();
+            if (i >= pool.size()) return false;
+            pool.check(i);
+            candidate = pool[i];
+            return true;
+        }
+
+        // return true if the neighbor enters top-k
+        bool push(const Neighbor& neighbor) { return pool.insert(neighbor) < k; }
+
+        void get_result(vector<Neighbor>& result) const {
+            for (const auto& candidate : pool) {
+                if (result.size() >= k) break;
+                result.emplace_back(candidate);
+            }
+        }
+    };
+
+    // visited table shared by threads searching the same query (epoch tagged)
+    struct SharedVisited {
+        unique_ptr<atomic<uint32_t>[]> tags;
+        size_t n = 0;
+        uint32_t epoch = 0;
+
+        // call before threads start searching
+        void reset(size_t n_node) {
+            if (n != n_node) {
+                n = n_node;
+                tags.reset(new atomic<uint32_t>[n]);
+                for (size_t i = 0; i < n; ++i) tags[i].store(0, memory_order_relaxed);
+                epoch = 0;
+            }
+            if (++epoch == 0) {
+                for (size_t i = 0; i < n; ++i) tags[i].store(0, memory_order_relaxed);
+                epoch = 1;
+            }
+        }
+
+        bool contains(size_t id) const { return tags[id].load(memory_order_relaxed) == epoch; }
+
+        // return true if this thread visits id first
+        bool insert(size_t id) {
+            if (contains(id)) return false;
+            return tags[id].exchange(epoch, memory_order_relaxed) != epoch;
+        }
+
+        void prefetch(size_t id) const { mylib::prefetch(&tags[id]); }
+    };
+
+    // distance bound shared by threads (minimum of their top-ef bounds)
+    struct SharedBound {
+        atomic<float> value{float_max};
+
+        void reset() { value.store(float_max, memory_order_relaxed); }
+        float load() const { return value.load(memory_order_relaxed); }
+
+        void update(float bound) {
+            auto current = load();
+            while (bound < current &&
+                   !value.compare_exchange_weak(current, bound, memory_order_relaxed)) {}
+        }
+    };
+
+    // shared state of a cooperative search
+    struct CooperativeState {
+        SharedVisited visited;
+        SharedBound bound;
+
+        // state owned by the calling thread
+        static CooperativeState& local() {
+            static thread_local CooperativeState state;
+            return state;
+        }
+
+        void reset(size_t n_node) {
+            visited.reset(n_node);
+            bound.reset();
+        }
+    };
+
+    // HeapQueue pruned by a bound shared with other threads
+    struct CooperativeQueue {
+        HeapQueue queue;
+        SharedBound& shared_bound;
+
+        CooperativeQueue(size_t ef, size_t k, SharedBound& shared_bound) :
+                queue(ef, k), shared_bound(shared_bound) {}
+
+        int peek() const { return queue.peek(); }
+
+        // stop when the nearest candidate is farther than the shared bound too
+        bool pop(Neighbor& candidate) {
+            if (!queue.pop(candidate)) return false;
+            return candidate.dist <= shared_bound.load();
+        }
+
+        bool push(const Neighbor& neighbor) {
+            if (neighbor.dist >= shared_bound.load()) return false;
+            const auto result_changed = queue.push(neighbor);
+            if (result_changed) shared_bound.update(queue.bound());
+            return result_changed;
+        }
+
+        void get_result(vector<Neighbor>& result) { queue.get_result(result); }
+    };
+
+    // termination rules are told the distance of each seed (on_start), each distance calculated
+    // by the traversal (on_dist) and the end of each hop (on_hop)
+
+    // stop when the queue converges
+    struct Converged {
+        void on_start(float) {}
+        void on_dist(float) {}
+        void on_hop(bool) {}
+        bool stop() const { return false; }
+    };
+
+    // stop after more than tol consecutive hops which do not update the result
+    struct Patience {
+        int tol, n_result_unchanged = 0;
+
+        explicit Patience(int tol) : tol(tol) {}
+
+        void on_start(float) {}
+        void on_dist(float) {}
+        void on_hop(bool result_changed) {
+            if (result_changed) n_result_unchanged = 0;
+            else ++n_result_unchanged;
+        }
+
+        bool stop() const { return n_result_unchanged > tol; }
+    };
+
+    // stop after more than tol hops which expand a candidate out of top-k of pool
+    struct PoolPatience {
+        PoolQueue& queue;
+        int tol, n_result_unchanged = 0;
+
+        PoolPatience(PoolQueue& queue, int tol) : queue(queue), tol(tol) {}
+
+        void on_start(float) {}
+        void on_dist(float) {}
+        void on_hop(bool) {}
+
+        bool stop() {
+            if (queue.pool.next_unchecked() < queue.k) return false;
+            return ++n_result_unchanged > tol;
+        }
+    };
+
+    // traversal features of a search after a hop
+    constexpr int n_stop_feature = 4;
+    using StopFeatures = array<float, n_stop_feature>;
+
+    // tracks top-k distances seen by a search and computes its traversal features
+    struct TopKTracker {
+        int k;
+        vector<float> top_k;    // sorted
+        float start_dist = float_max;
+        int n_hop = 0, n_unchanged = 0;
+        float churn = 0;        // moving average of hops which change top-k
+        bool changed = false;
+
+        explicit TopKTracker(int k) : k(k) { top_k.reserve(k + 1); }
+
+        bool full() const { return static_cast<int>(top_k.size()) >= k; }
+
+        // seeds give the distance of start nodes
+        void on_start(float dist) {
+            start_dist = min(start_dist, dist);
+            on_dist(dist);
+        }
+
+        void on_dist(float dist) {
+            if (full() && dist >= top_k.back()) return;
+            top_k.insert(upper_bound(top_k.begin(), top_k.end(), dist), dist);
+            if (static_cast<int>(top_k.size()) > k) top_k.pop_back();
+            changed = true;
+        }
+
+        void on_hop() {
+            ++n_hop;
+            n_unchanged = changed ? 0 : n_unchanged + 1;
+            churn = 0.8f * churn + 0.2f * changed;
+            changed = false;
+        }
+
+        // log of hops, ratio of the nearest distance to that of start nodes,
+        // churn and log of hops since top-k changed
+        StopFeatures features() const {
+            const auto ratio = start_dist > 0 && !top_k.empty() ? top_k.front() / start_dist : 1.0f;
+            return {log1p(static_cast<float>(n_hop)), ratio, churn, log1p(static_cast<float>(n_unchanged))};
+        }
+    };
+
+    // logistic model predicting that top-k of a search is final
+    struct StopModel {
+        vector<float> weights;   // empty if not trained
+        float bias = 0;
+        float threshold = 0.7;
+
+        bool empty() const { return weights.empty(); }
+
+        float predict(const StopFeatures& features) const {
+            auto z = bias;
+            for (int i = 0; i < n_stop_feature; ++i) z += weights[i] * features[i];
+            return 1 / (1 + exp(-z));
+        }
+
+        // features after hops of searches, labeled 1 if top-k did not change afterwards
+        void fit(const vector<StopFeatures>& features, const vector<int>& labels,
+                 int n_epoch = 200, float learning_rate = 0.5) {
+            weights.assign(n_stop_feature, 0);
+            bias = 0;
+            if (features.empty()) return;
+
+            for (int epoch = 0; epoch < n_epoch; ++epoch) {
+                vector<double> gradient(n_stop_feature + 1);
+                for (size_t i = 0; i < features.size(); ++i) {
+                    const auto error = predict(features[i]) - labels[i];
+                    for (int j = 0; j < n_stop_feature; ++j) gradient[j] += error * features[i][j];
+                    gradient[n_stop_feature] += error;
+                }
+                for (int j = 0; j < n_stop_feature; ++j)
+                    weights[j] -= learning_rate * gradient[j] / features.size();
+                bias -= learning_rate * gradient[n_stop_feature] / features.size();
+            }
+        }
+    };
+
+    // settings of adaptive termination (disabled if patience is 0 and model is empty)
+    struct EarlyStop {
+        int patience = 0;   // stop after more than patience hops which do not change top-k
+        StopModel model;    // stop when the model predicts that top-k is final
+
+        bool enabled() const { return patience > 0 || !model.empty(); }
+    };
+
+    // stop by patience on top-k or by the stop model (once top-k is full)
+    struct AdaptiveStop {
+        TopKTracker tracker;
+        const EarlyStop& settings;
+
+        AdaptiveStop(int k, const EarlyStop& settings) : tracker(k), settings(settings) {}
+
+        void on_start(float dist) { tracker.on_start(dist); }
+        void on_dist(float dist) { tracker.on_dist(dist); }
+        void on_hop(bool) { tracker.on_hop(); }
+
+        bool stop() const {
+            if (!tracker.full() || tracker.n_hop == 0) return false;
+            if (settings.patience > 0 && tracker.n_unchanged > settings.patience) return true;
+            return !settings.model.empty() &&
+                   settings.model.predict(tracker.features()) > settings.model.threshold;
+        }
+    };
+
+    // never stops, records features and top-k changes of each hop for training StopModel
+    struct StopRecorder {
+        TopKTracker tracker;
+        vector<StopFeatures> features;
+        int last_change_hop = 0;
+
+        explicit StopRecorder(int k) : tracker(k) {}
+
+        void on_start(float dist) { tracker.on_start(dist); }
+        void on_dist(float dist) { tracker.on_dist(dist); }
+
+        void on_hop(bool) {
+            if (tracker.changed) last_change_hop = tracker.n_hop;
+            tracker.on_hop();
+            features.emplace_back(tracker.features());
+        }
+
+        bool stop() const { return false; }
+
+        // label of hop h is 1 if no later hop changed top-k
+        void write(vector<StopFeatures>& all_features, vector<int>& labels) const {
+            for (int h = 0; h < static_cast<int>(features.size()); ++h) {
+                all_features.emplace_back(features[h]);
+                labels.emplace_back(h >= last_change_hop);
+            }
+        }
+    };
+
+    // source of start nodes of graph search (implementations are in entry_point.hpp)
+    struct EntryPointProvider {
+        virtual ~EntryPointProvider() = default;
+        virtual string name() const = 0;
+
+        // append start node ids for query to entry_ids
+        virtual void get(const Data<>& query, vector<int>& entry_ids) const = 0;
     };
 
     struct GraphIndex {
         vector<Node> nodes;
         int degree, max_degree;
+        int prefetch_distance = default_prefetch_distance;
+        bool optimized = false;
+        compression::CompressedGraph compressed;
+        string distance_type;
         DistanceFunction<> calc_dist;
+        shared_ptr<NodeLocks> locks;   // set to insert nodes while searching (see link)
 
-        GraphIndex(int degree) : degree(degree), max_degree(degree * 2),
-                                 calc_dist(select_distance()) {}
+        GraphIndex(int degree, const string& distance = "euclidean") :
+                degree(degree), max_degree(degree * 2),
+                distance_type(distance), calc_dist(select_distance(distance)) {}
 
-        auto size() const { return nodes.size(); }
+        // nodes visible to searches (nodes being appended by insertion are not counted)
+        size_t size() const { return locks ? locks->n_node.load() : nodes.size(); }
         auto begin() const { return nodes.begin(); }
         auto end() const { return nodes.end(); }
         auto& operator [] (size_t i) { return nodes[i]; }
@@ -60,6 +639,33 @@ namespace graph {
         const auto& operator [] (size_t i) const { return nodes[i]; }
         const auto& operator [] (const Node& n) const { return nodes[n.data.id]; }
 
+        // size of visited tables (nodes inserted during a search have ids below the capacity)
+        size_t visited_size() const { return locks ? nodes.capacity() : nodes.size(); }
+
+        // call f with the adjacency lists to search
+        // (lists are copied under their locks only while an insertion is in flight)
+        template <typename F>
+        void with_adjacency(F f) const {
+            if (!compressed.empty()) {
+                f(CompressedAdjacency{compressed});
+            }
+            else if (!locks) {
+                f(NodeAdjacency{nodes});
+            }
+            else {
+                const SearchScope scope(*locks);
+                if (scope.unlocked) f(NodeAdjacency{nodes});
+                else f(LockedNodeAdjacency{nodes, *locks});
+            }
+        }
+
+        // prefetch visited tag and vector of node
+        template <typename Visited>
+        void prefetch_node(int id, const Visited& visited) const {
+            visited.prefetch(id);
+            prefetch_data(nodes[id].data);
+        }
+
         void init_data(const Dataset<>& dataset) {
             for (const auto& data : dataset) {
                 nodes.emplace_back(data);
@@ -69,6 +675,12 @@ namespace graph {
         void load(const Dataset<>& series, const string& graph_path, int n) {
             init_data(series);
 
+            // binary file
+            if (is_bin(graph_path)) {
+                load_bin(graph_path);
+                return;
+            }
+
             // csv file
             if (is_csv(graph_path)) {
                 ifstream ifs(graph_path);
@@ -115,18 +727,64 @@ namespace graph {
             load(series, graph_path, n);
         }
 
+        void load_bin(const string& graph_path, bool prefault = false) {
+            const auto graph = MappedGraph(graph_path, prefault);
+            if (graph.size() != nodes.size()) throw runtime_error("Invalid number of nodes!");
+
+            // an optimized graph is used as it is
+            optimized = graph.is_optimized();
+            const auto limit = optimized ? -1 : degree;
+
+#pragma omp parallel for schedule(dynamic, 1024)
+            for (int i = 0; i < static_cast<int>(nodes.size()); ++i) {
+                auto& node = nodes[i];
+                const auto ids = graph.neighbors(i);
+                const auto dists = graph.has_dist() ? graph.distances(i) : nullptr;
+                const int n_neighbor = graph.degree(i);
+
+                node.neighbors.reserve(n_neighbor);
+                if (dists) {
+                    for (int j = 0; j < n_neighbor; ++j) {
+                        if (limit != -1 && static_cast<int>(node.neighbors.size()) >= limit) break;
+                        node.add_neighbor(dists[j], ids[j]);
+                    }
+                    continue;
+                }
+
+                // graph without distances: recompute them and keep the nearest
+                for (int j = 0; j < n_neighbor; ++j) {
+                    node.add_neighbor(calc_dist(node.data, nodes[ids[j]].data), ids[j]);
+                }
+                sort_neighbors(node.neighbors);
+                if (limit != -1 && static_cast<int>(node.neighbors.size()) > limit) {
+                    node.neighbors.erase(node.neighbors.begin() + limit, node.neighbors.end());
+                }
+            }
+        }
+
         void save(const string& save_path) {
+            if (!compressed.empty()) throw runtime_error("Can't save compressed graph");
+            // binary
+            if (is_bin(save_path)) {
+                const auto flags = graph_file_has_dist | (optimized ? graph_file_optimized : 0);
+                auto writer = GraphWriter(save_path, nodes.size(), flags);
+                for (const auto& node : nodes) {
+                    writer.add(node.neighbors.begin(), node.neighbors.end(),
+                               [](const Neighbor& n) { return n.id; },
+                               [](const Neighbor& n) { return n.dist; });
+                }
+                writer.close();
+                return;
+            }
+
             // csv
             if (is_csv(save_path)) {
                 ofstream ofs(save_path);
-                string line;
                 for (const auto& node : nodes) {
                     for (const auto& neighbor : node.neighbors) {
-                        line = to_string(node.data.id) + "," +
-                               to_string(neighbor.id) + "," +
-                               to_string(neighbor.dist) + "\n";
+                        ofs << node.data.id << ',' << neighbor.id << ','
+                            << to_string(neighbor.dist) << '\n';
                     }
-                    ofs << line;
                 }
                 return;
             }
@@ -149,141 +807,330 @@ namespace graph {
             }
         }
 
-        auto knn_search(const Data<>& query, int k, int ef,
-                const vector<int>& start_ids, int n_start_id) {
-            auto result = SearchResult();
-//            const auto start_time = get_now();
-
-            priority_queue<Neighbor, vector<Neighbor>, CompGreater> candidates;
-            priority_queue<Neighbor, vector<Neighbor>, CompLess> top_candidates;
-
-            vector<bool> visited(nodes.size());
-
-            Neighbors initial_candidates;
-
-            // calculate distance to start nodes
+        // greedy search kernel shared by all search variants
+        // (queue discipline, termination rule, metric and stats are resolved at compile time)
+        // (the search stops with the current result if budget is exhausted)
+        // (start_dists: distances to start nodes already calculated and counted by the caller)
+        template <typename Queue, typename Termination, typename Visited,
+                  typename Adjacency, typename Metric, typename Budget, bool CollectStats = collect_stats>
+        void search(const Data<>& query, const vector<int>& start_ids, int n_start_id, int n_seed,
+                    Queue& queue, Termination& termination, Visited& visited,
+                    const Adjacency& adjacency, const Metric& metric, Budget& budget,
+                    SearchResult& result, const float* start_dists = nullptr) const {
+            SearchStats<CollectStats> stats;
+
+            // calculate distance to start nodes at once
             n_start_id = min(n_start_id, (int)start_ids.size());
-            for (int i = 0; i < n_start_id; ++i) {
-                const auto start_id = start_ids[i];
-                const auto& start_node = nodes[start_id];
-                const auto dist = calc_dist(query, start_node.data);
+            if (!start_dists) {
+                static thread_local vector<const Data<>*> start_points;
+                static thread_local vector<float> calculated_dists;
+                start_points.resize(n_start_id);
+                calculated_dists.resize(n_start_id);
+                for (int i = 0; i < n_start_id; ++i) start_points[i] = &nodes[start_ids[i]].data;
+                metric.batch(query, start_points.data(), n_start_id, calculated_dists.data());
+                for (int i = 0; i < n_start_id; ++i) {
+                    stats.dist_calc();
+                    budget.dist_calc();
+                }
+                start_dists = calculated_dists.data();
+            }
 
-                initial_candidates.emplace_back(dist, start_id);
+            Neighbors initial_candidates;
+            initial_candidates.reserve(n_start_id);
+            for (int i = 0; i < n_start_id; ++i) initial_candidates.emplace_back(start_dists[i], start_ids[i]);
+            if (initial_candidates.empty()) return;
+
+            // seed the nearest n_seed start nodes (all seeds share the visited table)
+            if (n_seed < static_cast<int>(initial_candidates.size())) {
+                partial_sort(initial_candidates.begin(), initial_candidates.begin() + n_seed,
+                             initial_candidates.end(), CompLess());
+                initial_candidates.resize(n_seed);
             }
 
-            // decide nearest node as start node
-            sort_neighbors(initial_candidates);
-            const auto nearest_start_candidate = initial_candidates[0];
-            visited[nearest_start_candidate.id] = true;
-            candidates.emplace(nearest_start_candidate);
-            top_candidates.emplace(nearest_start_candidate);
+            result.dist_from_start = float_max;
+            for (const auto& candidate : initial_candidates) {
+                if (!visited.insert(candidate.id)) continue;
+                queue.push(candidate);
+                termination.on_start(candidate.dist);
+                result.dist_from_start = min(result.dist_from_start, (double)candidate.dist);
+            }
 
-            result.dist_from_start = nearest_start_candidate.dist;
+            Neighbor nearest_candidate;
+            while (!termination.stop()) {
+                if (budget.exhausted()) {
+                    result.incomplete = true;
+                    break;
+                }
 
-            while (!candidates.empty()) {
-                const auto nearest_candidate = candidates.top();
-                const auto& nearest_candidate_node = nodes[nearest_candidate.id];
-                candidates.pop();
+                const auto next_id = queue.peek();
+                if (next_id >= 0) adjacency.prefetch(next_id);
+                if (!queue.pop(nearest_candidate)) break;
 
-                if (nearest_candidate.dist > top_candidates.top().dist) break;
+                stats.hop();
+                budget.hop();
 
-                ++result.n_hop;
+                const auto neighbors = adjacency.get(nearest_candidate.id);
+                const int n_neighbor = neighbors.size();
+                for (int i = 0; i < min(prefetch_distance, n_neighbor); ++i) {
+                    prefetch_node(neighbors[i], visited);
+                }
 
-                for (const auto neighbor : nearest_candidate_node.neighbors) {
-                    if (visited[neighbor.id]) continue;
-                    visited[neighbor.id] = true;
+                bool result_changed = false;
+                for (int i = 0; i < n_neighbor; ++i) {
+                    if (i + prefetch_distance < n_neighbor) {
+                        prefetch_node(neighbors[i + prefetch_distance], visited);
+                    }
 
-                    const auto& neighbor_node = nodes[neighbor.id];
-                    const auto dist_from_neighbor =
-                            calc_dist(query, neighbor_node.data);
-                    ++result.n_dist_calc;
+                    const auto neighbor_id = neighbors[i];
+                    stats.node_access();
+                    if (!visited.insert(neighbor_id)) continue;
 
-                    if (dist_from_neighbor < top_candidates.top().dist ||
-                        top_candidates.size() < ef) {
-                        candidates.emplace(dist_from_neighbor, neighbor.id);
-                        top_candidates.emplace(dist_from_neighbor, neighbor.id);
+                    const auto dist = metric(query, nodes[neighbor_id].data);
+                    stats.dist_calc();
+                    budget.dist_calc();
+                    termination.on_dist(dist);
 
-                        if (top_candidates.size() > ef) top_candidates.pop();
-                    }
+                    result_changed |= queue.push(Neighbor(dist, neighbor_id));
                 }
-            }
 
-            while (!top_candidates.empty()) {
-                result.result.emplace_back(top_candidates.top());
-                top_candidates.pop();
+                termination.on_hop(result_changed);
             }
 
-            reverse(result.result.begin(), result.result.end());
-            if (result.result.size() > k) result.result.resize(k);
+            queue.get_result(result.result);
+            stats.write(result);
+        }
 
-//            const auto end_time = get_now();
-//            result.time = get_duration(start_time, end_time);
+        // run search kernel with the metric of this index
+        template <typename Queue, typename Termination, typename Visited, typename Budget = Unlimited>
+        auto run_search(const Data<>& query, const vector<int>& start_ids, int n_start_id,
+                        int n_seed, Queue& queue, Termination& termination, Visited& visited,
+                        Budget budget = Budget(), const float* start_dists = nullptr) const {
+            auto result = SearchResult();
+
+            const auto run = [&](const auto& adjacency) {
+                if (distance_type == "euclidean") {
+                    search(query, start_ids, n_start_id, n_seed, queue, termination,
+                           visited, adjacency, EuclideanMetric(), budget, result, start_dists);
+                } else {
+                    search(query, start_ids, n_start_id, n_seed, queue, termination,
+                           visited, adjacency, DynamicMetric{calc_dist}, budget, result, start_dists);
+                }
+            };
+
+            with_adjacency(run);
 
             return result;
         }
 
-        auto knn_search_nsg(const Data<>& query, int k, const vector<int>& start_ids, int l) {
-            auto result = SearchResult();
-            const auto start_time = get_now();
+        // run search kernel with a pooled visited table (expecting about visited_budget visits)
+        template <typename Queue, typename Termination, typename Budget = Unlimited>
+        auto run_search(const Data<>& query, const vector<int>& start_ids, int n_start_id,
+                        int n_seed, Queue& queue, Termination& termination, size_t visited_budget,
+                        Budget budget = Budget(), const float* start_dists = nullptr) const {
+            auto visited = get_visited(visited_size(), visited_budget);
+            return run_search(query, start_ids, n_start_id, n_seed, queue, termination, *visited, budget,
+                              start_dists);
+        }
 
-            vector<bool> checked(nodes.size()), added(nodes.size());
-            vector<Neighbor> candidates;
-            candidates.reserve(l + start_ids.size() + max_degree);
+        // search from the nearest n_seed of the first n_start_id start nodes
+        // (stop with the current result when budget is exhausted)
+        // (stop early by early_stop if enabled)
+        // (start_dists: distances to start nodes if already calculated, not counted again)
+        auto knn_search(const Data<>& query, int k, int ef, const vector<int>& start_ids,
+                        int n_start_id, int n_seed = 1, const SearchBudget& budget = SearchBudget(),
+                        const EarlyStop& early_stop = EarlyStop(), const float* start_dists = nullptr) const {
+            auto queue = HeapQueue(ef, k);
+            const size_t visited_budget = (ef + n_start_id) * max_degree;
+            const auto run = [&](auto& termination) {
+                if (!budget.limited()) {
+                    return run_search(query, start_ids, n_start_id, n_seed, queue, termination,
+                                      visited_budget, Unlimited(), start_dists);
+                }
+                return run_search(query, start_ids, n_start_id, n_seed, queue, termination,
+                                  visited_budget, BudgetCounter(budget), start_dists);
+            };
+
+            if (!early_stop.enabled()) {
+                auto termination = Converged();
+                return run(termination);
+            }
+            auto termination = AdaptiveStop(k, early_stop);
+            return run(termination);
+        }
+
+        // run knn_search to convergence and append features and labels of its hops for StopModel
+        void collect_stop_samples(const Data<>& query, int k, int ef, const vector<int>& start_ids,
+                                  int n_start_id, int n_seed, vector<StopFeatures>& features,
+                                  vector<int>& labels) const {
+            auto queue = HeapQueue(ef, k);
+            auto termination = StopRecorder(k);
+            run_search(query, start_ids, n_start_id, n_seed, queue, termination,
+                       static_cast<size_t>((ef + n_start_id) * max_degree));
+            termination.write(features, labels);
+        }
+
+        // search from start nodes given by provider (node 0 if none)
+        auto knn_search(const Data<>& query, int k, int ef, const EntryPointProvider& provider,
+                        int n_seed = 1, const SearchBudget& budget = SearchBudget(),
+                        const EarlyStop& early_stop = EarlyStop()) const {
+            static thread_local vector<int> entry_ids;
+            entry_ids.clear();
+            provider.get(query, entry_ids);
+            if (entry_ids.empty()) entry_ids.emplace_back(0);
+            return knn_search(query, k, ef, entry_ids, entry_ids.size(), n_seed, budget, early_stop);
+        }
 
-            for (const auto data_id : start_ids) {
-                added[data_id] = true;
-                const auto& start_node = nodes[data_id];
+        // one of threads searching the same query, which share visited nodes and the top-ef bound
+        // (state is reset by the calling thread before the threads start)
+        auto cooperative_knn_search(const Data<>& query, int k, int ef, const vector<int>& start_ids,
+                                    int n_start_id, CooperativeState& state, int n_seed = 1,
+                                    const SearchBudget& budget = SearchBudget()) const {
+            auto queue = CooperativeQueue(ef, k, state.bound);
+            auto termination = Converged();
+            if (!budget.limited()) {
+                return run_search(query, start_ids, n_start_id, n_seed, queue, termination, state.visited);
+            }
+            return run_search(query, start_ids, n_start_id, n_seed, queue, termination, state.visited,
+                              BudgetCounter(budget));
+        }
 
-                const auto dist_to_start_node = calc_dist(query, start_node.data);
-                ++result.n_dist_calc;
-                candidates.emplace_back(dist_to_start_node, data_id);
+        // top-k among nodes matching filter (filter(id) returns true for a matching node).
+        // non-matching nodes are traversed but not admitted into top-ef
+        template <typename Filter>
+        auto filtered_knn_search(const Data<>& query, int k, int ef, const Filter& filter,
+                                 const vector<int>& start_ids, int n_start_id, int n_seed = 1,
+                                 const SearchBudget& budget = SearchBudget()) const {
+            auto queue = FilteredHeapQueue<Filter>(ef, k, filter);
+            auto termination = Converged();
+            const size_t visited_budget = (ef + n_start_id) * max_degree;
+            if (!budget.limited()) {
+                return run_search(query, start_ids, n_start_id, n_seed, queue, termination, visited_budget);
             }
+            return run_search(query, start_ids, n_start_id, n_seed, queue, termination, visited_budget,
+                              BudgetCounter(budget));
+        }
 
-            sort(candidates.begin(), candidates.end(),
-                 [](const auto& n1, const auto& n2) { return n1.dist < n2.dist; });
+        // distances from query to nodes ids (batched as in search)
+        void calc_dists(const Data<>& query, const int* ids, int n, float* dists) const {
+            vector<const Data<>*> points(n);
+            for (int i = 0; i < n; ++i) points[i] = &nodes[ids[i]].data;
+            if (distance_type == "euclidean") EuclideanMetric().batch(query, points.data(), n, dists);
+            else DynamicMetric{calc_dist}.batch(query, points.data(), n, dists);
+        }
 
-            result.dist_from_start = candidates.front().dist;
+        // top-k among nodes matching filter by a linear scan (for very selective filters)
+        template <typename Filter>
+        auto filtered_scan_knn_search(const Data<>& query, int k, const Filter& filter) const {
+            const auto start_time = get_now();
+            auto result = SearchResult();
 
-            while (true) {
-                // find the first unchecked node
-                int first_unchecked_index = 0;
-                for (const auto candidate : candidates) {
-                    if (!checked[candidate.id]) break;
-                    ++first_unchecked_index;
+            const auto scan = [&](const auto& metric) {
+                priority_queue<Neighbor, Neighbors, CompLess> top_candidates;
+                const int n = size();
+                for (int id = 0; id < n; ++id) {
+                    if (!filter(id)) continue;
+                    const float dist = metric(query, nodes[id].data);
+                    ++result.n_dist_calc;
+                    if (static_cast<int>(top_candidates.size()) >= k && dist >= top_candidates.top().dist) continue;
+                    top_candidates.emplace(dist, id);
+                    if (static_cast<int>(top_candidates.size()) > k) top_candidates.pop();
                 }
+                for (; !top_candidates.empty(); top_candidates.pop()) result.result.emplace_back(top_candidates.top());
+                reverse(result.result.begin(), result.result.end());
+            };
 
-                // checked all candidates
-                if (first_unchecked_index >= l) break;
+            if (distance_type == "euclidean") scan(EuclideanMetric());
+            else scan(DynamicMetric{calc_dist});
 
-                ++result.n_hop;
+            result.time = get_duration(start_time, get_now());
+            return result;
+        }
 
-                const auto first_unchecked_node_id = candidates[first_unchecked_index].id;
-                checked[first_unchecked_node_id] = true;
-                const auto& first_unchecked_node = nodes[first_unchecked_node_id];
+        // all nodes within range of query (dist <= range), nearest first.
+        // a knn search (top-ef) from the start nodes reaches the region of query, then nodes are
+        // expanded in the order of distance while within range + slack, from its results and
+        // from every start node within range + slack (which may lie in other regions).
+        // slack starts at slack_ratio * range and grows to twice the margin of a node out of range
+        // whose expansion finds nodes in range (up to range)
+        auto range_search(const Data<>& query, float range, int ef, const vector<int>& start_ids,
+                          int n_start_id, int n_seed = 1, float slack_ratio = 0.1) const {
+            const auto start_time = get_now();
+            vector<float> start_dists(n_start_id);
+            calc_dists(query, start_ids.data(), n_start_id, start_dists.data());
+            auto result = knn_search(query, ef, ef, start_ids, n_start_id, n_seed, SearchBudget(), EarlyStop(),
+                                     start_dists.data());
+            result.n_dist_calc += n_start_id;
+
+            const auto run = [&](const auto& adjacency, const auto& metric) {
+                auto slack = slack_ratio * range;
+                auto visited = get_visited(visited_size(), (ef + n_start_id) * max_degree);
+                priority_queue<Neighbor, Neighbors, CompGreater> frontier;
+                for (const auto& seed : result.result) {
+                    visited->insert(seed.id);
+                    frontier.push(seed);
+                }
+                for (int i = 0; i < n_start_id; ++i) {
+                    if (start_dists[i] > range + slack || !visited->insert(start_ids[i])) continue;
+                    frontier.emplace(start_dists[i], start_ids[i]);
+                }
 
-                for (const auto& neighbor : first_unchecked_node.neighbors) {
-                    result.n_node_access++;
+                Neighbors in_range;
+                const auto max_slack = max(slack, range);
+                while (!frontier.empty() && frontier.top().dist <= range + slack) {
+                    const auto candidate = frontier.top();
+                    frontier.pop();
+                    if (candidate.dist <= range) in_range.emplace_back(candidate);
+                    ++result.n_hop;
+
+                    bool found_in_range = false;
+                    const auto neighbors = adjacency.get(candidate.id);
+                    const int n_neighbor = neighbors.size();
+                    for (int i = 0; i < min(prefetch_distance, n_neighbor); ++i) {
+                        prefetch_node(neighbors[i], *visited);
+                    }
+                    for (int i = 0; i < n_neighbor; ++i) {
+                        if (i + prefetch_distance < n_neighbor) {
+                            prefetch_node(neighbors[i + prefetch_distance], *visited);
+                        }
 
-                    if (added[neighbor.id]) continue;
-                    added[neighbor.id] = true;
+                        const auto neighbor_id = neighbors[i];
+                        ++result.n_node_access;
+                        if (!visited->insert(neighbor_id)) continue;
 
-                    result.n_dist_calc++;
+                        const auto dist = metric(query, nodes[neighbor_id].data);
+                        ++result.n_dist_calc;
+                        found_in_range |= dist <= range;
+                        frontier.emplace(dist, neighbor_id);
+                    }
 
-                    const auto& neighbor_node = nodes[neighbor.id];
-                    const auto dist = calc_dist(query, neighbor_node.data);
-                    candidates.emplace_back(dist, neighbor.id);
+                    // a bridge to nodes in range, look further out of range
+                    if (candidate.dist > range && found_in_range) {
+                        slack = min(max_slack, max(slack, 2 * (candidate.dist - range)));
+                    }
                 }
 
-                // sort and resize candidates l
-                sort(candidates.begin(), candidates.end(),
-                     [](const auto& n1, const auto& n2) { return n1.dist < n2.dist; });
-                candidates.resize(l);
-            }
+                // nodes found through a bridge out of range are popped after farther ones
+                sort_neighbors(in_range);
+                result.result = move(in_range);
+            };
 
-            for (const auto& c : candidates) {
-                result.result.emplace_back(c);
-                if (result.result.size() >= k) break;
-            }
+            const auto run_metric = [&](const auto& adjacency) {
+                if (distance_type == "euclidean") run(adjacency, EuclideanMetric());
+                else run(adjacency, DynamicMetric{calc_dist});
+            };
+            with_adjacency(run_metric);
+
+            result.time = get_duration(start_time, get_now());
+            return result;
+        }
+
+        auto knn_search_nsg(const Data<>& query, int k, const vector<int>& start_ids, int l) const {
+            const auto start_time = get_now();
+
+            auto queue = PoolQueue(l, k);
+            auto termination = Converged();
+            auto result = run_search(query, start_ids, start_ids.size(), start_ids.size(),
+                                     queue, termination, (l + start_ids.size()) * max_degree);
 
             const auto end_time = get_now();
             result.time = get_duration(start_time, end_time);
@@ -291,217 +1138,441 @@ namespace graph {
             return result;
         }
 
-        auto knn_search(const Data<>& query, int k, int start_id, int l) {
+        auto knn_search(const Data<>& query, int k, int start_id, int l) const {
             const auto start_series = vector<int>{start_id};
             return knn_search_nsg(query, k, start_series, l);
         }
 
         auto tolerant_knn_search(const Data<>& query, int k,
-                                 const vector<int>& start_ids, int tol) {
-            auto result = SearchResult();
+                                 const vector<int>& start_ids, int tol) const {
             const auto start_time = get_now();
 
-            vector<bool> checked(nodes.size()), added(nodes.size());
-
-            priority_queue<Neighbor, vector<Neighbor>, CompGreater> candidates;
-            priority_queue<Neighbor, vector<Neighbor>, CompLess> top_candidates;
+            auto queue = HeapQueue(k, k, false);
+            auto termination = Patience(tol);
+            auto result = run_search(query, start_ids, start_ids.size(), start_ids.size(),
+                                     queue, termination, 0);
 
-            // init candidates
-            for (const auto& start_id : start_ids) {
-                if (added[start_id]) continue;
-                added[start_id] = true;
-                const auto& start_node = nodes[start_id];
-
-                const auto dist_to_start_node = calc_dist(query, start_node.data);
-                candidates.emplace(dist_to_start_node, start_id);
-            }
+            const auto end_time = get_now();
+            result.time = get_duration(start_time, end_time);
 
-            result.dist_from_start = candidates.top().dist;
+            return result;
+        }
 
-            int n_result_unchanged = 0;
-            while (true) {
-                const auto nearest_candidate_id = candidates.top().id;
-                const auto& nearest_candidate = nodes[nearest_candidate_id];
-                checked[nearest_candidate_id] = true;
-                candidates.pop();
+        // pool of the nearest max(l, k) candidates, stop after more than tol hops out of top-k
+        auto tolerant_knn_search_nsg(const Data<>& query, int k, const vector<int>& start_ids,
+                                     int l, int tol) const {
+            const auto start_time = get_now();
 
-                result.n_hop++;
+            const auto pool_size = max(l, k);
+            auto queue = PoolQueue(pool_size, k);
+            auto termination = PoolPatience(queue, tol);
+            auto result = run_search(query, start_ids, start_ids.size(), start_ids.size(),
+                                     queue, termination, (pool_size + start_ids.size()) * max_degree);
 
-                bool result_changed = false;
-                for (const auto neighbor : nearest_candidate.neighbors) {
-                    result.n_node_access++;
+            const auto end_time = get_now();
+            result.time = get_duration(start_time, end_time);
 
-                    if (added[neighbor.id]) continue;
-                    added[neighbor.id] = true;
+            return result;
+        }
 
-                    result.n_dist_calc++;
+        // search on compressed adjacency lists
+        // (release: free neighbors of nodes, which are needed only to modify the graph)
+        void compress(bool release = false) {
+            if (!compressed.empty()) throw runtime_error("Graph is already compressed");
+            compressed.build(nodes.size(), [&](size_t i) {
+                vector<uint32_t> ids;
+                for (const auto& neighbor : nodes[i].neighbors) ids.emplace_back(neighbor.id);
+                return ids;
+            });
+
+            if (!release) return;
+#pragma omp parallel for schedule(dynamic, 1024)
+            for (int i = 0; i < static_cast<int>(nodes.size()); ++i) {
+                auto& node = nodes[i];
+                Neighbors().swap(node.neighbors);
+                unordered_map<size_t, bool>().swap(node.added);
+            }
+        }
 
-                    const auto& neighbor_node = nodes[neighbor.id];
-                    const auto dist = calc_dist(query, neighbor_node.data);
-                    candidates.emplace(dist, neighbor.id);
+        // relabel nodes for cache locality (order[new id] = old id)
+        void reorder(const vector<int>& order) {
+            if (!compressed.empty()) throw runtime_error("Can't reorder compressed graph");
+            const int n = nodes.size();
+            vector<int> new_ids(n);
+            for (int i = 0; i < n; ++i) new_ids[order[i]] = i;
+
+            vector<Node> new_nodes(n);
+#pragma omp parallel for schedule(dynamic, 1024)
+            for (int i = 0; i < n; ++i) {
+                auto& node = new_nodes[i];
+                node = move(nodes[order[i]]);
+                node.id = i;
+                node.data.id = i;
+
+                node.added.clear();
+                node.added[i] = true;
+                for (auto& neighbor : node.neighbors) {
+                    neighbor.id = new_ids[neighbor.id];
+                    node.added[neighbor.id] = true;
+                }
+            }
+            nodes = move(new_nodes);
+        }
 
-                    if (top_candidates.empty()) {
-                        top_candidates.emplace(dist, neighbor.id);
-                        continue;
+        // breadth first order from roots (unreached nodes are appended as new roots)
+        vector<int> bfs_order(const vector<int>& roots) const {
+            if (!compressed.empty()) throw runtime_error("Can't order compressed graph");
+            const int n = nodes.size();
+            vector<int> order;
+            order.reserve(n);
+            vector<bool> visited(n);
+
+            const auto bfs = [&](int root) {
+                if (visited[root]) return;
+                visited[root] = true;
+                auto head = order.size();
+                order.emplace_back(root);
+
+                for (; head < order.size(); ++head) {
+                    for (const auto& neighbor : nodes[order[head]].neighbors) {
+                        if (visited[neighbor.id]) continue;
+                        visited[neighbor.id] = true;
+                        order.emplace_back(neighbor.id);
                     }
+                }
+            };
 
-                    if (dist < top_candidates.top().dist || top_candidates.size() < k) {
-                        top_candidates.emplace(dist, neighbor.id);
-                        if (top_candidates.size() > k) top_candidates.pop();
-                        result_changed = true;
+            for (const auto root : roots) bfs(root);
+            for (int id = 0; id < n; ++id) bfs(id);
+            return order;
+        }
+
+        // reverse Cuthill-McKee order
+        vector<int> rcm_order() const {
+            if (!compressed.empty()) throw runtime_error("Can't order compressed graph");
+            const int n = nodes.size();
+            vector<int> order;
+            order.reserve(n);
+            vector<bool> visited(n);
+
+            // start from nodes with the smallest degree
+            vector<int> by_degree(n);
+            iota(by_degree.begin(), by_degree.end(), 0);
+            stable_sort(by_degree.begin(), by_degree.end(), [&](int id1, int id2) {
+                return nodes[id1].neighbors.size() < nodes[id2].neighbors.size(); });
+
+            vector<int> next_ids;
+            for (const auto root : by_degree) {
+                if (visited[root]) continue;
+                visited[root] = true;
+                order.emplace_back(root);
+
+                for (auto head = order.size() - 1; head < order.size(); ++head) {
+                    // visit neighbors in ascending order of degree
+                    next_ids.clear();
+                    for (const auto& neighbor : nodes[order[head]].neighbors) {
+                        if (visited[neighbor.id]) continue;
+                        visited[neighbor.id] = true;
+                        next_ids.emplace_back(neighbor.id);
                     }
+                    stable_sort(next_ids.begin(), next_ids.end(), [&](int id1, int id2) {
+                        return nodes[id1].neighbors.size() < nodes[id2].neighbors.size(); });
+                    order.insert(order.end(), next_ids.begin(), next_ids.end());
                 }
+            }
 
-                if (result_changed) n_result_unchanged = 0;
-                else ++n_result_unchanged;
+            reverse(order.begin(), order.end());
+            return order;
+        }
 
-                if (n_result_unchanged > tol) break;
-            }
+        void make_reverse() {
 
-            while (!top_candidates.empty()) {
-                result.result.emplace_back(top_candidates.top());
-                top_candidates.pop();
+        }
+
+        void make_bidirectional() {
+            if (!compressed.empty()) throw runtime_error("Can't modify compressed graph");
+            const int n = nodes.size();
+
+            // count reverse edges of the original (immutable) neighbors
+            vector<size_t> offsets(n + 1);
+#pragma omp parallel for
+            for (int id = 0; id < n; ++id) {
+                for (const auto& neighbor : nodes[id].neighbors) {
+#pragma omp atomic
+                    ++offsets[neighbor.id + 1];
+                }
             }
+            for (int id = 0; id < n; ++id) offsets[id + 1] += offsets[id];
 
-            reverse(result.result.begin(), result.result.end());
+            // bucket reverse edges by their source with counting sort
+            vector<Neighbor> reverse_edges(offsets[n]);
+            vector<size_t> cursors(offsets.begin(), offsets.end() - 1);
+#pragma omp parallel for
+            for (int id = 0; id < n; ++id) {
+                for (const auto& neighbor : nodes[id].neighbors) {
+                    size_t i;
+#pragma omp atomic capture
+                    i = cursors[neighbor.id]++;
+                    reverse_edges[i] = Neighbor(neighbor.dist, id);
+                }
+            }
 
-            const auto end_time = get_now();
-            result.time = get_duration(start_time, end_time);
+            // add reverse edges in order of node id
+#pragma omp parallel for schedule(dynamic, 1024)
+            for (int id = 0; id < n; ++id) {
+                const auto first = reverse_edges.begin() + offsets[id];
+                const auto last = reverse_edges.begin() + offsets[id + 1];
+                sort(first, last, [](const Neighbor& n1, const Neighbor& n2) {
+                    return n1.id < n2.id; });
 
-            return result;
+                auto& node = nodes[id];
+                for (auto it = first; it != last; ++it) node.add_neighbor(it->dist, it->id);
+            }
         }
 
-        auto tolerant_knn_search_nsg(const Data<>& query, int k,
-                                 const vector<int>& start_ids, int tol) {
-            auto result = SearchResult();
-            const auto start_time = get_now();
-
-            vector<bool> checked(nodes.size()), added(nodes.size());
-            vector<Neighbor> candidates;
+        template <typename Metric>
+        void optimize_node_edge(Node& node, const Metric& metric) {
+            auto& neighbors = node.neighbors;
+            if (static_cast<int>(neighbors.size()) < max_degree) return;
+
+            // sort edges with its length
+            sort(neighbors.begin(), neighbors.end(),
+                 [](const Neighbor& n1, const Neighbor& n2) {
+                     return n1.dist < n2.dist; });
+
+            // select appropriate edge
+            auto added = get_visited(visited_size(), neighbors.size());
+            vector<Neighbor> new_neighbors;
+            new_neighbors.emplace_back(neighbors.front());
+            added->insert(neighbors.front().id);
+
+            for (const auto& candidate : neighbors) {
+                if (added->contains(candidate.id)) continue;
+                const auto& candidate_node = nodes[candidate.id];
+
+                bool good = true;
+                for (const auto& new_neighbor : new_neighbors) {
+                    const auto& new_neighbor_node = nodes[new_neighbor.id];
+                    const auto dist = metric(candidate_node.data, new_neighbor_node.data);
+
+                    if (dist < candidate.dist) {
+                        good = false;
+                        break;
+                    }
+                }
 
-            // init candidates
-            for (const auto& start_id : start_ids) {
-                if (added[start_id]) continue;
-                added[start_id] = true;
-                const auto& start_node = nodes[start_id];
+                if (!good) continue;
+                added->insert(candidate.id);
+                new_neighbors.emplace_back(candidate);
 
-                const auto dist_to_start_node = calc_dist(query, start_node.data);
-                candidates.emplace_back(dist_to_start_node, start_id);
+                if (static_cast<int>(new_neighbors.size()) >= max_degree) break;
             }
 
-            result.dist_from_start = candidates.front().dist;
+            for (const auto& candidate : neighbors) {
+                if (static_cast<int>(new_neighbors.size()) >= max_degree) break;
+                if (!added->insert(candidate.id)) continue;
+                new_neighbors.emplace_back(candidate);
+            }
 
-            int n_result_unchanged = 0;
-            while (true) {
-                sort(candidates.begin(), candidates.end(),
-                     [](const Neighbor& n1, const Neighbor& n2) {
-                         return n1.dist < n2.dist; });
+            node.neighbors = new_neighbors;
+        }
 
-                // find the first unchecked node
-                int first_unchecked_index = 0;
-                for (const auto candidate : candidates) {
-                    if (!checked[candidate.id]) break;
-                    ++first_unchecked_index;
-                }
+        // room for capacity nodes to insert while searching (no search may run during reserve)
+        void reserve(size_t capacity) {
+            nodes.reserve(capacity);
+            if (!locks) locks = make_shared<NodeLocks>();
+            locks->n_node = nodes.size();
+        }
 
-                // checked all candidates
-                if (first_unchecked_index >= candidates.size()) break;
+        // append a node without edges and return its id (see link),
+        // it is counted by size() after publish
+        int add_node(const Data<>& data) {
+            lock_guard<mutex> guard(locks->append);
+            // searches may run, so nodes must not be reallocated
+            if (nodes.size() >= nodes.capacity()) throw runtime_error("No capacity reserved for node");
+            const int id = nodes.size();
+            nodes.emplace_back(Data<>(id, data.x));
+            return id;
+        }
 
-                // not update top-k candidates
-                if (first_unchecked_index >= k) {
-                    ++n_result_unchanged;
-                    if (n_result_unchanged > tol) break;
+        // count nodes up to id in size() (call in order of ids, after data of id is complete)
+        void publish(int id) { locks->n_node = id + 1; }
+
+        // link node id to its neighbors found by search (top-max(ef, 2 * max_degree)) from start nodes,
+        // pruned by the rule of optimize_edge, and add the reverse edges.
+        // searches and other insertions may run at the same time if locks is set
+        // and capacity of nodes is reserved
+        void link(int id, const vector<int>& start_ids, int ef, int n_seed = 1) {
+            const auto run = [&](const auto& metric) {
+                const InsertionScope scope(*locks);
+                auto& node = nodes[id];
+                const auto n_candidate = max(ef, 2 * max_degree);
+                const auto result = knn_search(node.data, n_candidate, n_candidate, start_ids,
+                                               start_ids.size(), n_seed);
+
+                Neighbors neighbors;
+                {
+                    lock_guard<mutex> guard(locks->of(id));
+                    for (const auto& neighbor : result.result) {
+                        if (neighbor.id != id) node.add_neighbor(neighbor.dist, neighbor.id);
+                    }
+                    optimize_node_edge(node, metric);
+                    neighbors = node.neighbors;
                 }
 
-                const auto first_unchecked_node_id = candidates[first_unchecked_index].id;
-                checked[first_unchecked_node_id] = true;
-                const auto& first_unchecked_node = nodes[first_unchecked_node_id];
+                // reverse edges (a neighbor over max_degree is pruned again)
+                for (const auto& neighbor : neighbors) {
+                    auto& neighbor_node = nodes[neighbor.id];
+                    lock_guard<mutex> guard(locks->of(neighbor.id));
+                    neighbor_node.add_neighbor(neighbor.dist, id);
+                    if (static_cast<int>(neighbor_node.neighbors.size()) > max_degree) optimize_node_edge(neighbor_node, metric);
+                }
+            };
 
-                for (const auto neighbor : first_unchecked_node.neighbors) {
-                    result.n_node_access++;
+            if (!locks) throw runtime_error("Can't insert without locks");
+            if (!compressed.empty()) throw runtime_error("Can't insert into compressed graph");
+            if (distance_type == "euclidean") run(EuclideanMetric());
+            else run(DynamicMetric{calc_dist});
+        }
 
-                    if (added[neighbor.id]) continue;
-                    added[neighbor.id] = true;
+        void optimize_edge() {
+            if (!compressed.empty()) throw runtime_error("Can't modify compressed graph");
+            // each node reads only vectors of other nodes, so nodes are pruned in parallel
+#pragma omp parallel for schedule(dynamic, 256)
+            for (int id = 0; id < static_cast<int>(nodes.size()); ++id) {
+                if (distance_type == "euclidean") optimize_node_edge(nodes[id], EuclideanMetric());
+                else optimize_node_edge(nodes[id], DynamicMetric{calc_dist});
+            }
+            optimized = true;
+        }
+    };
 
-                    result.n_dist_calc++;
+    // resumable search: next(m) returns the next m neighbors of the same traversal,
+    // so the caller can ask for more results without searching again.
+    // candidates are kept in binary heaps, trimmed to the nearest max_frontier once they double.
+    // visited nodes are kept for the whole traversal so that no node is returned twice:
+    // the hash set grows with n_dist_calc (about max_degree ids per expanded node),
+    // so a cursor is meant for a bounded number of pages (up to the graph size)
+    struct SearchCursor {
+        const GraphIndex& graph;
+        Data<> query;
+        int ef;
+        size_t max_frontier;
+        const vector<int>* original_ids;   // ids written to results (internal ids if null)
+        VisitedHashSet visited;
+        Neighbors frontier;     // min heap of candidates not returned yet
+        Neighbors unexpanded;   // min heap of candidates whose neighbors are not visited yet
+        unsigned long n_returned = 0, n_dist_calc = 0, n_hop = 0;
+
+        // search from the nearest n_seed of the first n_start_id start nodes
+        SearchCursor(const GraphIndex& graph, const Data<>& query, const vector<int>& start_ids,
+                     int n_start_id, int ef, size_t max_frontier, int n_seed = 1,
+                     const vector<int>* original_ids = nullptr) :
+                graph(graph), query(query), ef(ef), max_frontier(max(max_frontier, size_t(ef))),
+                original_ids(original_ids) {
+            visited.reset((ef + n_start_id) * graph.max_degree);
 
-                    const auto& neighbor_node = nodes[neighbor.id];
-                    const auto dist = calc_dist(query, neighbor_node.data);
-                    candidates.emplace_back(dist, neighbor.id);
-                }
+            Neighbors initial_candidates;
+            n_start_id = min(n_start_id, (int)start_ids.size());
+            for (int i = 0; i < n_start_id; ++i) {
+                initial_candidates.emplace_back(graph.calc_dist(query, graph[start_ids[i]].data), start_ids[i]);
+                ++n_dist_calc;
             }
-
-            for (const auto& result_pair : candidates) {
-                result.result.emplace_back(result_pair);
-                if (result.result.size() >= k) break;
+            if (n_seed < static_cast<int>(initial_candidates.size())) {
+                partial_sort(initial_candidates.begin(), initial_candidates.begin() + n_seed,
+                             initial_candidates.end(), CompLess());
+                initial_candidates.resize(n_seed);
             }
+            for (const auto& candidate : initial_candidates) {
+                if (visited.insert(candidate.id)) insert(candidate);
+            }
+        }
 
-            const auto end_time = get_now();
-            result.time = get_duration(start_time, end_time);
+        // false if all reachable nodes were returned or dropped from the frontier
+        bool has_next() const { return !frontier.empty(); }
+
+        // next m neighbors (fewer if the traversal is exhausted), nearest first within a call
+        vector<Neighbor> next(int m) {
+            if (graph.distance_type == "euclidean") expand(m, EuclideanMetric());
+            else expand(m, DynamicMetric{graph.calc_dist});
 
+            vector<Neighbor> result;
+            while (static_cast<int>(result.size()) < m && !frontier.empty()) {
+                pop_heap(frontier.begin(), frontier.end(), CompGreater());
+                result.emplace_back(frontier.back());
+                frontier.pop_back();
+            }
+            n_returned += result.size();
+
+            if (original_ids) for (auto& neighbor : result) neighbor.id = (*original_ids)[neighbor.id];
             return result;
         }
 
-        void make_reverse() {
+    private:
+        void insert(const Neighbor& neighbor) {
+            frontier.emplace_back(neighbor);
+            push_heap(frontier.begin(), frontier.end(), CompGreater());
+            unexpanded.emplace_back(neighbor);
+            push_heap(unexpanded.begin(), unexpanded.end(), CompGreater());
+            if (frontier.size() >= 2 * max_frontier) trim();
+        }
 
+        // keep the nearest max_frontier candidates (and the unexpanded ones among them)
+        void trim() {
+            nth_element(frontier.begin(), frontier.begin() + max_frontier - 1, frontier.end(), CompLess());
+            const auto max_dist = frontier[max_frontier - 1].dist;
+            frontier.resize(max_frontier);
+            make_heap(frontier.begin(), frontier.end(), CompGreater());
+
+            unexpanded.erase(remove_if(unexpanded.begin(), unexpanded.end(),
+                                       [&](const Neighbor& neighbor) { return neighbor.dist > max_dist; }),
+                             unexpanded.end());
+            make_heap(unexpanded.begin(), unexpanded.end(), CompGreater());
         }
 
-        void make_bidirectional() {
-            for (auto& node : nodes) {
-                for (const auto& neighbor : node.neighbors) {
-                    // add reverse edge
-                    nodes[neighbor.id].add_neighbor(neighbor.dist, node.id);
+        // expand candidates until the nearest max(ef, m) candidates are expanded
+        template <typename Metric>
+        void expand(int m, const Metric& metric) {
+            const auto run = [&](const auto& adjacency) {
+                const auto window = static_cast<size_t>(max(ef, m));
+                // distances of the nearest window candidates (max heap)
+                priority_queue<float> top_dists;
+                for (const auto& candidate : frontier) {
+                    top_dists.emplace(candidate.dist);
+                    if (top_dists.size() > window) top_dists.pop();
                 }
-            }
-        }
 
-        void optimize_edge() {
-            for (auto& node : nodes) {
-                auto& neighbors = node.neighbors;
-                if (neighbors.size() < max_degree) continue;
-
-                // sort edges with its length
-                sort(neighbors.begin(), neighbors.end(),
-                     [](const Neighbor& n1, const Neighbor& n2) {
-                         return n1.dist < n2.dist; });
-
-                // select appropriate edge
-                vector<bool> added(nodes.size());
-                vector<Neighbor> new_neighbors;
-                new_neighbors.emplace_back(neighbors.front());
-
-                for (const auto& candidate : neighbors) {
-                    const auto& candidate_node = nodes[candidate.id];
-
-                    bool good = true;
-                    for (const auto& new_neighbor : new_neighbors) {
-                        const auto& new_neighbor_node = nodes[new_neighbor.id];
-                        const auto dist = calc_dist(
-                                candidate_node.data, new_neighbor_node.data);
-
-                        if (dist < candidate.dist) {
-                            good = false;
-                            break;
-                        }
+                while (!unexpanded.empty()) {
+                    const auto candidate = unexpanded.front();
+                    if (top_dists.size() >= window && candidate.dist > top_dists.top()) break;
+                    pop_heap(unexpanded.begin(), unexpanded.end(), CompGreater());
+                    unexpanded.pop_back();
+                    ++n_hop;
+
+                    const auto neighbors = adjacency.get(candidate.id);
+                    const int n_neighbor = neighbors.size();
+                    for (int i = 0; i < min(graph.prefetch_distance, n_neighbor); ++i) {
+                        graph.prefetch_node(neighbors[i], visited);
                     }
+                    for (int i = 0; i < n_neighbor; ++i) {
+                        if (i + graph.prefetch_distance < n_neighbor) {
+                            graph.prefetch_node(neighbors[i + graph.prefetch_distance], visited);
+                        }
 
-                    if (!good) continue;
-                    added[candidate.id] = true;
-                    new_neighbors.emplace_back(candidate);
-
-                    if (new_neighbors.size() >= max_degree) break;
-                }
-
-                for (const auto& candidate : neighbors) {
-                    if (new_neighbors.size() >= max_degree) break;
+                        const auto neighbor_id = neighbors[i];
+                        if (!visited.insert(neighbor_id)) continue;
+                        const auto neighbor = Neighbor(metric(query, graph[neighbor_id].data), neighbor_id);
+                        ++n_dist_calc;
+                        insert(neighbor);
 
-                    if (added[candidate.id]) continue;
-                    added[candidate.id] = true;
-                    new_neighbors.emplace_back(candidate);
+                        if (top_dists.size() >= window && neighbor.dist >= top_dists.top()) continue;
+                        top_dists.emplace(neighbor.dist);
+                        if (top_dists.size() > window) top_dists.pop();
+                    }
                 }
+            };
 
-                node.neighbors = new_neighbors;
-            }
+            graph.with_adjacency(run);
         }
     };
 }
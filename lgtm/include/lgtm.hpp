@@ -6,6 +6,12 @@
 
 #include <lsh.hpp>
 #include <graph.hpp>
+#include <worker_pool.hpp>
+#include <entry_cache.hpp>
+#include <result_cache.hpp>
+#include <attribute.hpp>
+#include <mips.hpp>
+#include <shared_mutex>
 
 namespace lgtm {
     struct SearchResult {
@@ -18,6 +24,8 @@ namespace lgtm {
         unsigned long n_node_access = 0;
         unsigned long n_dist_calc = 0;
         unsigned long n_hop = 0;
+        unsigned long n_table = 0;   // number of hash tables searched
+        bool incomplete = false;     // a graph search was stopped by the search budget
         double dist_from_start = 0;
         double recall = 0;
     };
@@ -30,7 +38,7 @@ namespace lgtm {
             ofstream log_ofs(log_path);
             string line = "time,lsh_time,graph_time,merge_time,"
                           "n_bucket_content,n_node_access,n_dist_calc,"
-                          "n_hop,dist_from_start,recall";
+                          "n_hop,dist_from_start,recall,n_table,incomplete";
             log_ofs << line << endl;
 
             ofstream result_ofs(result_path);
@@ -48,7 +56,9 @@ namespace lgtm {
                         to_string(result.n_dist_calc) + "," +
                         to_string(result.n_hop) + "," +
                         to_string(result.dist_from_start) + "," +
-                        to_string(result.recall);
+                        to_string(result.recall) + "," +
+                        to_string(result.n_table) + "," +
+                        to_string(result.incomplete);
                 log_ofs << line << endl;
 
                 for (const auto& neighbor : result.result) {
@@ -63,12 +73,101 @@ namespace lgtm {
         }
     };
 
+    // snapshot file of LGTMIndex:
+    // header, vectors, hash params, hash tables, graph (degrees, neighbor ids, distances),
+    // original ids, attributes
+    constexpr char snapshot_magic[8] = {'L', 'G', 'T', 'M', 'S', 'N', 'A', 'P'};
+    constexpr uint32_t snapshot_version = 3;
+
+    void write_string(ostream& os, const string& str) {
+        write_binary(os, static_cast<uint64_t>(str.size()));
+        write_binary(os, str.data(), str.size());
+    }
+
+    string read_string(BinaryReader& reader) {
+        string str(reader.read<uint64_t>(), '\0');
+        reader.read(&str[0], str.size());
+        return str;
+    }
+
+    // merge sorted results into the nearest k unique neighbors (fewer if not found)
+    // (cost depends only on the number of results and k)
+    template <typename Iterator>
+    void merge_results(Iterator first, Iterator last, int k, vector<Neighbor>& merged) {
+        static thread_local VisitedHashSet added;
+        static thread_local vector<size_t> cursors;
+        const int n_result = distance(first, last);
+        added.reset(n_result * k);
+        cursors.assign(n_result, 0);
+        merged.reserve(k);
+
+        while (static_cast<int>(merged.size()) < k) {
+            // take the nearest head of results
+            int nearest = -1;
+            float nearest_dist = float_max;
+            for (int i = 0; i < n_result; ++i) {
+                const auto& result = first[i].result;
+                if (cursors[i] >= result.size()) continue;
+                if (nearest >= 0 && result[cursors[i]].dist >= nearest_dist) continue;
+                nearest = i;
+                nearest_dist = result[cursors[i]].dist;
+            }
+            if (nearest < 0) break;
+
+            const auto& neighbor = first[nearest].result[cursors[nearest]++];
+            if (added.insert(neighbor.id)) merged.emplace_back(neighbor);
+        }
+    }
+
+    // number of neighbors in both results
+    int count_common(const vector<Neighbor>& result_1, const vector<Neighbor>& result_2) {
+        int n_common = 0;
+        for (const auto& n1 : result_1) {
+            for (const auto& n2 : result_2) {
+                if (n1.id != n2.id) continue;
+                ++n_common;
+                break;
+            }
+        }
+        return n_common;
+    }
+
+    struct BatchSearchResult {
+        SearchResults results;
+        time_t time = 0;
+        double qps = 0;
+    };
+
+    // locks for inserting points while searching
+    struct InsertLocks {
+        mutex append;   // adding a point
+        vector<shared_timed_mutex> tables;
+
+        explicit InsertLocks(int L) : tables(L) {}
+    };
+
     struct LGTMIndex {
         int n_thread;
         lsh::LSHIndex lsh;
         graph::GraphIndex graph;
-
-        LGTMIndex(int m, int r, int L, int degree) : n_thread(L), lsh(m, r, L), graph(degree) {}
+        vector<int> original_ids;   // original id of each node after reordering
+        shared_ptr<worker_pool::WorkerPool> pool;   // used by knn_search_para instead of OpenMP if set
+        bool cooperative = false;   // searches of hash tables share visited nodes and bound
+        int n_adaptive_table = 0;   // tables searched per round of adaptive search (0: search all)
+        float agreement = 0.8;      // stop adaptive search if this ratio of top-k is unchanged by a round
+        int n_seed = 1;             // start nodes which seed each graph search (0: all start nodes)
+        shared_ptr<entry_cache::EntryCache> entry_cache;   // result nodes of recent queries per bucket
+        shared_ptr<result_cache::ResultCache> result_cache;   // results of recent queries
+        graph::SearchBudget budget;   // limits of each graph search (time is counted from start of query)
+        graph::EarlyStop early_stop;  // adaptive termination of graph search (not used by cooperative search)
+        attribute::AttributeStore attributes;   // attributes of nodes (internal ids)
+        double brute_force_selectivity = 0.01;  // filtered search scans all nodes below this selectivity
+        bool filter_start_nodes = false;        // filtered search starts from matching bucket contents
+        mips::MipsTransform mips;   // transform of data for inner product (unused if max_sqr_norm is 0)
+        shared_ptr<InsertLocks> insert_locks;   // locks of hash tables for insert (set by reserve)
+
+        LGTMIndex(int m, double w, int L, int degree, const string& distance = "euclidean") :
+                n_thread(L), lsh(m, w, L, distance), graph(degree, distance) {}
 
         void build_lsh(const Dataset<>& dataset) {
             // build ordinal lsh index
@@ -101,8 +200,10 @@ namespace lgtm {
             }
         }
 
-        void build(const string& data_path, const string& graph_path, int n) {
+        // inner_product: index data transformed by MipsTransform (queries need transform_query)
+        void build(const string& data_path, const string& graph_path, int n, bool inner_product = false) {
             auto dataset_1 = load_data(data_path, n);
+            if (inner_product) mips.transform_dataset(dataset_1);
             auto dataset_2 = dataset_1;
             cout << "complete: load data" << endl;
 
@@ -110,17 +211,370 @@ namespace lgtm {
             cout << "complete: build lsh" << endl;
 
             graph.load(dataset_2, graph_path, n);
-            graph.make_bidirectional();
-            graph.optimize_edge();
+            if (!graph.optimized) {
+                graph.make_bidirectional();
+                graph.optimize_edge();
+            }
             cout << "complete: build graph" << endl;
         }
 
-        auto knn_search(const Data<>& query, int k, int n_start_node, int ef) {
+        void save(const string& snapshot_path) const {
+            if (!graph.compressed.empty()) throw runtime_error("Can't save compressed graph");
+
+            ofstream ofs(snapshot_path, ios::binary);
+            if (!ofs) throw runtime_error("Can't open file!: " + snapshot_path);
+
+            const auto& dataset = lsh.dataset;
+            const uint64_t n = dataset.size(), dim = lsh.dim;
+
+            // header
+            write_binary(ofs, snapshot_magic, sizeof(snapshot_magic));
+            write_binary(ofs, snapshot_version);
+            write_binary(ofs, static_cast<int32_t>(lsh.m));
+            write_binary(ofs, static_cast<int32_t>(lsh.L));
+            write_binary(ofs, lsh.w);
+            write_binary(ofs, static_cast<uint32_t>(lsh.seed));
+            write_binary(ofs, static_cast<int32_t>(graph.degree));
+            write_binary(ofs, n);
+            write_binary(ofs, dim);
+            write_string(ofs, graph.distance_type);
+            write_binary(ofs, mips.max_sqr_norm);
+
+            // vectors
+            for (const auto& data : dataset) write_binary(ofs, data.x.data(), dim);
+
+            // hash params
+            for (const auto& family_params : lsh.hash_params) {
+                for (const auto& params : family_params) {
+                    write_binary(ofs, params.a.data(), dim);
+                    write_binary(ofs, params.b);
+                }
+            }
+
+            // hash tables
+            for (const auto& hash_table : lsh.hash_tables) {
+                write_binary(ofs, static_cast<uint64_t>(hash_table.size()));
+                for (const auto& bucket : hash_table) {
+                    write_binary(ofs, bucket.first.data(), lsh.m);
+                    write_binary(ofs, static_cast<uint64_t>(bucket.second.size()));
+                    write_binary(ofs, bucket.second.data(), bucket.second.size());
+                }
+            }
+
+            // graph
+            for (const auto& node : graph.nodes)
+                write_binary(ofs, static_cast<uint32_t>(node.neighbors.size()));
+            for (const auto& node : graph.nodes)
+                for (const auto& neighbor : node.neighbors)
+                    write_binary(ofs, static_cast<uint32_t>(neighbor.id));
+            for (const auto& node : graph.nodes)
+                for (const auto& neighbor : node.neighbors)
+                    write_binary(ofs, neighbor.dist);
+
+            // id translation
+            write_binary(ofs, static_cast<uint64_t>(original_ids.size()));
+            write_binary(ofs, original_ids.data(), original_ids.size());
+
+            // attributes
+            write_binary(ofs, static_cast<uint64_t>(attributes.columns.size()));
+            for (size_t c = 0; c < attributes.columns.size(); ++c) {
+                const auto& column = attributes.columns[c];
+                write_string(ofs, attributes.names[c]);
+                write_binary(ofs, static_cast<uint64_t>(column.size()));
+                write_binary(ofs, column.data(), column.size());
+            }
+
+            ofs.close();
+            if (!ofs) throw runtime_error("Can't write file!: " + snapshot_path);
+        }
+
+        // the snapshot is copied into the containers of the index and unmapped on return
+        // prefault: read the whole snapshot into page cache at once
+        static LGTMIndex load(const string& snapshot_path, bool prefault = false) {
+            const auto file = MappedFile(snapshot_path, prefault);
+            auto reader = BinaryReader(file);
+
+            // header
+            char magic[sizeof(snapshot_magic)];
+            reader.read(magic, sizeof(magic));
+            if (!equal(begin(snapshot_magic), end(snapshot_magic), magic))
+                throw runtime_error("Invalid snapshot!: " + snapshot_path);
+            if (reader.read<uint32_t>() != snapshot_version)
+                throw runtime_error("Unsupported snapshot version!: " + snapshot_path);
+
+            const auto m = reader.read<int32_t>();
+            const auto L = reader.read<int32_t>();
+            const auto w = reader.read<double>();
+            const auto seed = reader.read<uint32_t>();
+            const auto degree = reader.read<int32_t>();
+            const auto n = reader.read<uint64_t>();
+            const auto dim = reader.read<uint64_t>();
+            const auto distance_type = read_string(reader);
+
+            auto index = LGTMIndex(m, w, L, degree, distance_type);
+            index.mips.max_sqr_norm = reader.read<float>();
+            auto& lsh = index.lsh;
+            auto& graph = index.graph;
+
+            // vectors
+            auto& dataset = lsh.dataset;
+            dataset.resize(n);
+            for (size_t i = 0; i < n; ++i) {
+                auto& data = dataset[i];
+                data.id = i;
+                data.x.resize(dim);
+                reader.read(data.x.data(), dim);
+            }
+            lsh.dim = dim;
+            lsh.seed = seed;
+
+            // hash params
+            lsh.hash_params.resize(L);
+            for (auto& family_params : lsh.hash_params) {
+                family_params.resize(m);
+                for (auto& params : family_params) {
+                    params.a.resize(dim);
+                    reader.read(params.a.data(), dim);
+                    params.b = reader.read<double>();
+                }
+                lsh.G.push_back(lsh.make_hash_family(family_params));
+            }
+
+            // continue the random engine from where a fresh build with the seed leaves it
+            lsh.engine.seed(seed);
+            for (int i = 0; i < L * m; ++i) lsh.create_hash_params();
+
+            // hash tables
+            for (auto& hash_table : lsh.hash_tables) {
+                const auto n_bucket = reader.read<uint64_t>();
+                hash_table.reserve(n_bucket);
+                for (size_t i = 0; i < n_bucket; ++i) {
+                    vector<int> key(m);
+                    reader.read(key.data(), m);
+                    auto& bucket = hash_table[key];
+                    bucket.resize(reader.read<uint64_t>());
+                    reader.read(bucket.data(), bucket.size());
+                }
+            }
+
+            // graph
+            graph.init_data(dataset);
+            vector<uint32_t> degrees(n);
+            reader.read(degrees.data(), n);
+            vector<uint64_t> offsets(n + 1);
+            for (size_t i = 0; i < n; ++i) offsets[i + 1] = offsets[i] + degrees[i];
+
+            const auto ids = reader.skip<uint32_t>(offsets[n]);
+            const auto dists = reader.skip<float>(offsets[n]);
+
+            // neighbors are assigned from the mapped arrays at once
+            // (Node::added is not filled, nodes inserted later are linked by their new ids)
+#pragma omp parallel for schedule(dynamic, 1024)
+            for (int i = 0; i < static_cast<int>(n); ++i) {
+                auto& neighbors = graph.nodes[i].neighbors;
+                neighbors.resize(degrees[i]);
+                for (size_t j = 0; j < degrees[i]; ++j) {
+                    uint32_t id;
+                    memcpy(&id, ids + (offsets[i] + j) * sizeof(uint32_t), sizeof(id));
+                    memcpy(&neighbors[j].dist, dists + (offsets[i] + j) * sizeof(float), sizeof(float));
+                    neighbors[j].id = id;
+                }
+            }
+            graph.optimized = true;
+
+            // id translation
+            index.original_ids.resize(reader.read<uint64_t>());
+            reader.read(index.original_ids.data(), index.original_ids.size());
+
+            // attributes
+            const auto n_column = reader.read<uint64_t>();
+            for (size_t c = 0; c < n_column; ++c) {
+                const auto name = read_string(reader);
+                vector<int> column(reader.read<uint64_t>());
+                reader.read(column.data(), column.size());
+                index.attributes.add_column(name, column);
+            }
+
+            return index;
+        }
+
+        // relabel vectors, graph and buckets with a cache friendly order ("bfs" or "rcm")
+        void reorder(const string& method) {
+            vector<int> order;
+            if (method == "bfs") {
+                // start from entry points of hash tables
+                vector<int> roots;
+                for (const auto& hash_table : lsh.hash_tables)
+                    for (const auto& bucket : hash_table) roots.emplace_back(bucket.second.front());
+                order = graph.bfs_order(roots);
+            }
+            else if (method == "rcm") order = graph.rcm_order();
+            else throw runtime_error("invalid reorder method: " + method);
+
+            const int n = order.size();
+            vector<int> new_ids(n);
+            for (int i = 0; i < n; ++i) new_ids[order[i]] = i;
+
+            graph.reorder(order);
+
+            auto& dataset = lsh.dataset;
+            Dataset<> new_dataset(n);
+            for (int i = 0; i < n; ++i) {
+                new_dataset[i] = move(dataset[order[i]]);
+                new_dataset[i].id = i;
+            }
+            dataset = move(new_dataset);
+
+            for (auto& hash_table : lsh.hash_tables)
+                for (auto& bucket : hash_table)
+                    for (auto& id : bucket.second) id = new_ids[id];
+
+            // compose with previous relabeling
+            if (original_ids.empty()) original_ids = order;
+            else {
+                vector<int> new_original_ids(n);
+                for (int i = 0; i < n; ++i) new_original_ids[i] = original_ids[order[i]];
+                original_ids = move(new_original_ids);
+            }
+            if (attributes.size() > 0) attributes.reorder(order);
+        }
+
+        // attributes of points in the original order
+        void set_attributes(attribute::AttributeStore store) {
+            if (!original_ids.empty()) store.reorder(original_ids);
+            attributes = move(store);
+        }
+
+        // predicate on attributes of points (counted between insertions of points)
+        attribute::Predicate make_predicate(const vector<attribute::Condition>& conditions) const {
+            unique_lock<mutex> guard;
+            if (insert_locks) guard = unique_lock<mutex>(insert_locks->append);
+            return attribute::Predicate(attributes, conditions);
+        }
+
+        // room for capacity points to insert while searching (no search may run during reserve)
+        void reserve(size_t capacity) {
+            graph.reserve(capacity);
+            lsh.dataset.reserve(capacity);
+            if (!original_ids.empty()) original_ids.reserve(capacity);
+            for (auto& column : attributes.columns) column.reserve(capacity);
+            if (!insert_locks) insert_locks = make_shared<InsertLocks>(lsh.L);
+        }
+
+        // add a point (x of original dimension, attribute_values if attributes are set) and return its id.
+        // its neighbors are found by search from its buckets and linked by GraphIndex::link,
+        // then it is added to its buckets. searches and other insertions may run at the same time.
+        // (results cached before insertion can be returned without the point)
+        int insert(const vector<float>& x, int n_start_node, int ef,
+                   const vector<int>& attribute_values = {}) {
+            if (!insert_locks) throw runtime_error("Can't insert before reserve");
+            if (!attributes.columns.empty() && attribute_values.size() != attributes.columns.size())
+                throw runtime_error("Invalid number of attribute values!");
+
+            auto data = Data<>(0, x);
+            if (mips.max_sqr_norm > 0) mips.transform_data(data);
+
+            {
+                lock_guard<mutex> guard(insert_locks->append);
+                if (lsh.dataset.size() >= lsh.dataset.capacity())
+                    throw runtime_error("No capacity reserved for point");
+                data.id = graph.add_node(data);
+                lsh.dataset.emplace_back(data);
+                if (!original_ids.empty()) original_ids.emplace_back(original_ids.size());
+                if (!attributes.columns.empty()) attributes.append(attribute_values);
+                graph.publish(data.id);
+            }
+
+            // graph
+            vector<int> start_ids;
+            get_all_start_ids(data, n_start_node, start_ids);
+            graph.link(data.id, start_ids, ef, get_n_seed(n_start_node) * lsh.L);
+
+            // lsh
+            for (int i = 0; i < lsh.L; ++i) {
+                const auto key = lsh.hash_key(data, i);
+                lock_guard<shared_timed_mutex> guard(insert_locks->tables[i]);
+                lsh.hash_tables[i][key].emplace_back(data.id);
+            }
+
+            return data.id;
+        }
+
+        int get_n_seed(int n_start_node) const { return n_seed > 0 ? n_seed : n_start_node; }
+
+        graph::SearchBudget get_budget(chrono::system_clock::time_point start_time) const {
+            auto query_budget = budget;
+            query_budget.start_time = start_time;
+            return query_budget;
+        }
+
+        // start nodes in table for query: nodes cached for the bucket, then the bucket
+        // (only nodes matching predicate if given and any matches, node 0 if none),
+        // returns the size of the bucket
+        size_t get_start_ids(const Data<>& query, int table_id, int n_start_node,
+                             vector<int>& start_ids, uint64_t& cache_key,
+                             const attribute::Predicate* predicate = nullptr) const {
+            start_ids.clear();
+            const auto key = lsh.hash_key(query, table_id);
+            if (entry_cache && !predicate) {
+                cache_key = entry_cache::EntryCache::make_key(table_id, key);
+                entry_cache->get(cache_key, start_ids);
+            }
+
+            const auto lock = lock_table(table_id);
+            const auto bucket = lsh.find_bucket(key, table_id);
+            const auto bucket_size = bucket ? bucket->size() : 0;
+            if (bucket) {
+                const auto begin = start_ids.size();
+                if (predicate) {
+                    for (const auto id : *bucket) {
+                        if (static_cast<int>(start_ids.size() - begin) >= n_start_node) break;
+                        if ((*predicate)(id)) start_ids.emplace_back(id);
+                    }
+                }
+                if (start_ids.size() == begin) {
+                    const auto n_bucket_start = min<size_t>(n_start_node, bucket->size());
+                    start_ids.insert(start_ids.end(), bucket->begin(), bucket->begin() + n_bucket_start);
+                }
+            }
+            if (start_ids.empty()) start_ids.emplace_back(0);
+            return bucket_size;
+        }
+
+        // shared lock of a hash table against insert (no lock before reserve)
+        shared_lock<shared_timed_mutex> lock_table(int table_id) const {
+            if (!insert_locks) return shared_lock<shared_timed_mutex>();
+            return shared_lock<shared_timed_mutex>(insert_locks->tables[table_id]);
+        }
+
+        // start nodes of query in all tables (without duplicates)
+        void get_all_start_ids(const Data<>& query, int n_start_node, vector<int>& start_ids) const {
+            static thread_local vector<int> table_start_ids;
+            uint64_t cache_key;
+            start_ids.clear();
+            for (int i = 0; i < lsh.L; ++i) {
+                get_start_ids(query, i, n_start_node, table_start_ids, cache_key);
+                start_ids.insert(start_ids.end(), table_start_ids.begin(), table_start_ids.end());
+            }
+            sort(start_ids.begin(), start_ids.end());
+            start_ids.erase(unique(start_ids.begin(), start_ids.end()), start_ids.end());
+        }
+
+        // translate ids of result into original ids
+        void restore_ids(vector<Neighbor>& result) const {
+            if (original_ids.empty()) return;
+            for (auto& neighbor : result) neighbor.id = original_ids[neighbor.id];
+        }
+
+        auto knn_search(const Data<>& query, int k, int n_start_node, int ef) const {
             auto result = SearchResult();
             const auto start_time = get_now();
 
             // lsh
+            vector<shared_lock<shared_timed_mutex>> locks;
+            for (int i = 0; i < lsh.L; ++i) locks.emplace_back(lock_table(i));
             auto start_ids = lsh.find(query, n_start_node);
+            locks.clear();
             if (start_ids.empty()) start_ids.emplace_back(0);
 
             result.n_bucket_content = start_ids.size();
@@ -130,13 +584,18 @@ namespace lgtm {
             // graph
             const auto graph_start_time = get_now();
 
-            auto graph_result = graph.knn_search(query, k, ef, start_ids, n_start_node);
+            auto graph_result = graph.knn_search(query, k, ef, start_ids, n_start_node,
+                                                 get_n_seed(n_start_node), get_budget(start_time),
+                                                 early_stop);
 
             result.result = graph_result.result;
             result.n_node_access = graph_result.n_node_access;
             result.n_dist_calc = graph_result.n_dist_calc;
             result.n_hop = graph_result.n_hop;
             result.dist_from_start = graph_result.dist_from_start;
+            result.n_table = 1;
+            result.incomplete = graph_result.incomplete;
+            restore_ids(result.result);
 
             const auto end_time = get_now();
             result.graph_time = get_duration(graph_start_time, end_time);
@@ -145,47 +604,210 @@ namespace lgtm {
             return result;
         }
 
-        auto knn_search_para(const Data<>& query, int k, int n_start_node, int ef) {
+        // all points within range of query (the distance of the graph), nearest first.
+        // graph search is seeded from the buckets of all tables and expanded while within
+        // range + slack (see GraphIndex::range_search)
+        auto range_search(const Data<>& query, float range, int n_start_node, int ef,
+                          float slack_ratio = 0.1) const {
             auto result = SearchResult();
             const auto start_time = get_now();
 
-            vector<graph::SearchResult> graph_results(n_thread);
-#pragma omp parallel for num_threads(n_thread) schedule(dynamic, 1)
+            vector<int> start_ids;
+            get_all_start_ids(query, n_start_node, start_ids);
+            result.n_bucket_content = start_ids.size();
+            const auto graph_start_time = get_now();
+            result.lsh_time = get_duration(start_time, graph_start_time);
+
+            auto graph_result = graph.range_search(query, range, ef, start_ids, start_ids.size(),
+                                                   get_n_seed(n_start_node) * lsh.L, slack_ratio);
+            result.result = move(graph_result.result);
+            result.n_node_access = graph_result.n_node_access;
+            result.n_dist_calc = graph_result.n_dist_calc;
+            result.n_hop = graph_result.n_hop;
+            result.dist_from_start = graph_result.dist_from_start;
+            result.n_table = lsh.L;
+            restore_ids(result.result);
+
+            const auto end_time = get_now();
+            result.graph_time = get_duration(graph_start_time, end_time);
+            result.time = get_duration(start_time, end_time);
+            return result;
+        }
+
+        // resumable search from the buckets of all tables (results have original ids),
+        // the frontier keeps at most max_frontier candidates
+        graph::SearchCursor search_cursor(const Data<>& query, int n_start_node, int ef,
+                                          size_t max_frontier) const {
+            vector<int> start_ids;
+            get_all_start_ids(query, n_start_node, start_ids);
+            return graph::SearchCursor(graph, query, start_ids, start_ids.size(), ef, max_frontier,
+                                       get_n_seed(n_start_node) * lsh.L,
+                                       original_ids.empty() ? nullptr : &original_ids);
+        }
+
+        // search graph from hash tables (in parallel if parallel is true),
+        // results of exact or near duplicate queries are taken from result_cache if set
+        SearchResult knn_search_para(const Data<>& query, int k, int n_start_node, int ef,
+                                     bool parallel = true) const {
+            const auto search = [&]() {
+                return n_adaptive_table > 0 ? adaptive_knn_search(query, k, n_start_node, ef, parallel) :
+                       search_all_tables(query, k, n_start_node, ef, parallel);
+            };
+            if (!result_cache) return search();
+
+            const auto start_time = get_now();
+            const auto params = search_params_hash(n_start_node, ef);
+            const auto key = result_cache::ResultCache::make_key(query, params);
+            const auto signature = result_cache->near_enabled() ? lsh_signature(query, params) : 0;
+
+            auto result = SearchResult();
+            if (result_cache->get(query, k, key, signature, result.result)) {
+                result.time = get_duration(start_time, get_now());
+                return result;
+            }
+
+            // a result cut short by the budget is not reused
+            result = search();
+            if (!result.incomplete) result_cache->put(query, k, key, signature, result.result);
+            return result;
+        }
+
+        // hash of the settings which change results of knn_search_para (other than k)
+        uint64_t search_params_hash(int n_start_node, int ef) const {
+            using result_cache::hash_bytes;
+            auto hash = hash_bytes(&ef, sizeof(ef));
+            hash = hash_bytes(&n_start_node, sizeof(n_start_node), hash);
+            hash = hash_bytes(&n_seed, sizeof(n_seed), hash);
+            hash = hash_bytes(&cooperative, sizeof(cooperative), hash);
+            hash = hash_bytes(&n_adaptive_table, sizeof(n_adaptive_table), hash);
+            hash = hash_bytes(&agreement, sizeof(agreement), hash);
+            hash = hash_bytes(&budget.max_time, sizeof(budget.max_time), hash);
+            hash = hash_bytes(&budget.max_hop, sizeof(budget.max_hop), hash);
+            hash = hash_bytes(&budget.max_dist_calc, sizeof(budget.max_dist_calc), hash);
+
+            const auto& model = early_stop.model;
+            hash = hash_bytes(&early_stop.patience, sizeof(early_stop.patience), hash);
+            hash = hash_bytes(model.weights.data(), model.weights.size() * sizeof(float), hash);
+            hash = hash_bytes(&model.bias, sizeof(model.bias), hash);
+            return hash_bytes(&model.threshold, sizeof(model.threshold), hash);
+        }
+
+        // hash of bucket keys of query in all tables
+        uint64_t lsh_signature(const Data<>& query, uint64_t seed) const {
+            auto signature = seed;
             for (int i = 0; i < n_thread; ++i) {
-                // lsh
-                const auto& hash_table = lsh.hash_tables[i];
-                const auto key = lsh.G[i](query);
-
-                try {
-                    const auto& start_ids = hash_table.at(key);
-                    graph_results[i] = graph.knn_search(query, k, ef, start_ids, n_start_node);
-                } catch (out_of_range) {
-                    const auto start_ids = vector<int>{0};
-                    graph_results[i] = graph.knn_search(query, k, ef, start_ids, n_start_node);
-                }
+                const auto key = lsh.hash_key(query, i);
+                signature = result_cache::hash_bytes(key.data(), key.size() * sizeof(int), signature);
             }
+            return signature;
+        }
+
+        // search graph from every hash table
+        SearchResult search_all_tables(const Data<>& query, int k, int n_start_node, int ef,
+                                       bool parallel = true) const {
+            auto result = SearchResult();
+            const auto start_time = get_now();
+
+            auto& state = graph::CooperativeState::local();
+            const auto cooperate = cooperative && parallel;
+            if (cooperate) state.reset(graph.visited_size());
+
+            const auto query_budget = get_budget(start_time);
+            vector<graph::SearchResult> graph_results(n_thread);
+            vector<uint64_t> cache_keys(n_thread);
+            auto search_table = [&](int i) {
+                // lsh
+                static thread_local vector<int> start_ids;
+                get_start_ids(query, i, n_start_node, start_ids, cache_keys[i]);
+                const int n_start_id = start_ids.size();
+                graph_results[i] = cooperate ?
+                        graph.cooperative_knn_search(query, k, ef, start_ids, n_start_id, state,
+                                                     get_n_seed(n_start_node), query_budget) :
+                        graph.knn_search(query, k, ef, start_ids, n_start_id, get_n_seed(n_start_node),
+                                         query_budget, early_stop);
+            };
+
+            run_tables(n_thread, search_table, parallel);
 
             // merge
             const auto merge_start_time = get_now();
 
-            vector<bool> added(lsh.dataset.size());
+            merge_results(graph_results.begin(), graph_results.end(), k, result.result);
+            result.n_table = n_thread;
+            if (entry_cache) {
+                for (const auto cache_key : cache_keys) entry_cache->put(cache_key, result.result);
+            }
             for (const auto& graph_result : graph_results) {
-                for (const auto& neighbor : graph_result.result) {
-                    if (added[neighbor.id]) continue;
-                    added[neighbor.id] = true;
-                    result.result.emplace_back(neighbor);
-                }
-
                 result.lsh_time = max(result.lsh_time, graph_result.lsh_time);
                 result.graph_time = max(result.graph_time, graph_result.time);
                 result.n_node_access = max(result.n_node_access, graph_result.n_node_access);
                 result.n_dist_calc = max(result.n_dist_calc, graph_result.n_dist_calc);
                 result.n_hop = max(result.n_hop, graph_result.n_hop);
                 result.dist_from_start = max(result.dist_from_start, graph_result.dist_from_start);
+                result.incomplete |= graph_result.incomplete;
+            }
+
+            restore_ids(result.result);
+
+            const auto end_time = get_now();
+            result.time = get_duration(start_time, end_time);
+            result.merge_time = get_duration(merge_start_time, end_time);
+
+            return result;
+        }
+
+        // top-k among points matching predicate (on attributes).
+        // graph searches from all tables traverse non-matching nodes but return only matching ones,
+        // a predicate matching less than brute_force_selectivity of points, or fewer points than
+        // graph search is expected to calculate distances to (ef * max degree / selectivity), is answered by a scan
+        SearchResult filtered_knn_search(const Data<>& query, int k, int n_start_node, int ef,
+                                         const attribute::Predicate& predicate, bool parallel = true) const {
+            auto result = SearchResult();
+            const auto start_time = get_now();
+
+            const auto selectivity = predicate.selectivity();
+            if (selectivity < brute_force_selectivity ||
+                predicate.n_match * selectivity <= static_cast<double>(ef) * graph.max_degree) {
+                const auto scan_result = graph.filtered_scan_knn_search(query, k, predicate);
+                result.result = scan_result.result;
+                result.n_dist_calc = scan_result.n_dist_calc;
+                result.graph_time = scan_result.time;
+                restore_ids(result.result);
+                result.time = get_duration(start_time, get_now());
+                return result;
+            }
+
+            const auto query_budget = get_budget(start_time);
+            vector<graph::SearchResult> graph_results(n_thread);
+            auto search_table = [&](int i) {
+                // lsh (matching bucket contents if filter_start_nodes, all start nodes if none matches)
+                static thread_local vector<int> start_ids;
+                uint64_t cache_key;
+                get_start_ids(query, i, n_start_node, start_ids, cache_key,
+                              filter_start_nodes ? &predicate : nullptr);
+
+                const int n_start_id = start_ids.size();
+                graph_results[i] = graph.filtered_knn_search(query, k, ef, predicate, start_ids, n_start_id,
+                                                             get_n_seed(n_start_node), query_budget);
+            };
+
+            run_tables(n_thread, search_table, parallel);
+
+            // merge
+            const auto merge_start_time = get_now();
+
+            merge_results(graph_results.begin(), graph_results.end(), k, result.result);
+            result.n_table = n_thread;
+            for (const auto& graph_result : graph_results) {
+                result.graph_time = max(result.graph_time, graph_result.time);
+                result.n_node_access = max(result.n_node_access, graph_result.n_node_access);
+                result.n_dist_calc = max(result.n_dist_calc, graph_result.n_dist_calc);
+                result.n_hop = max(result.n_hop, graph_result.n_hop);
+                result.dist_from_start = max(result.dist_from_start, graph_result.dist_from_start);
+                result.incomplete |= graph_result.incomplete;
             }
 
-            sort_neighbors(result.result);
-            result.result.resize(k);
+            restore_ids(result.result);
 
             const auto end_time = get_now();
             result.time = get_duration(start_time, end_time);
@@ -193,6 +815,133 @@ namespace lgtm {
 
             return result;
         }
+
+        // search tables in order of their nearest start node, n_adaptive_table at a time,
+        // until a round leaves the merged top-k almost unchanged
+        SearchResult adaptive_knn_search(const Data<>& query, int k, int n_start_node, int ef,
+                                         bool parallel = true) const {
+            auto result = SearchResult();
+            const auto start_time = get_now();
+
+            // lsh: rank tables by distance to their nearest start node, then by bucket size
+            // (the distances are counted here and reused by the graph searches)
+            vector<vector<int>> start_ids(n_thread);
+            vector<vector<float>> start_dists(n_thread);
+            vector<uint64_t> cache_keys(n_thread);
+            vector<pair<float, long>> ranks(n_thread);
+            for (int i = 0; i < n_thread; ++i) {
+                const auto bucket_size = get_start_ids(query, i, n_start_node, start_ids[i], cache_keys[i]);
+                ranks[i] = {float_max, -static_cast<long>(bucket_size)};
+
+                start_dists[i].resize(start_ids[i].size());
+                graph.calc_dists(query, start_ids[i].data(), start_ids[i].size(), start_dists[i].data());
+                for (const auto dist : start_dists[i]) ranks[i].first = min(ranks[i].first, dist);
+                result.n_dist_calc += start_ids[i].size();
+            }
+
+            vector<int> tables(n_thread);
+            iota(tables.begin(), tables.end(), 0);
+            sort(tables.begin(), tables.end(), [&](int i, int j) { return ranks[i] < ranks[j]; });
+            result.lsh_time = get_duration(start_time, get_now());
+
+            // graph (results are stored in order of rank)
+            const auto query_budget = get_budget(start_time);
+            vector<graph::SearchResult> graph_results(n_thread);
+            vector<Neighbor> merged, previous;
+            int n_searched = 0;
+            while (true) {
+                const int n_search = min(max(n_adaptive_table, 1), n_thread - n_searched);
+                auto search_table = [&](int i) {
+                    const auto table = tables[n_searched + i];
+                    const auto& table_start_ids = start_ids[table];
+                    graph_results[n_searched + i] = graph.knn_search(query, k, ef, table_start_ids,
+                                                                     table_start_ids.size(),
+                                                                     get_n_seed(n_start_node), query_budget,
+                                                                     early_stop, start_dists[table].data());
+                };
+                run_tables(n_search, search_table, parallel);
+
+                // first round is compared with the search from the best table
+                if (n_searched == 0) merge_results(graph_results.begin(), graph_results.begin() + 1, k, previous);
+                n_searched += n_search;
+
+                const auto merge_start_time = get_now();
+                merged.clear();
+                merge_results(graph_results.begin(), graph_results.begin() + n_searched, k, merged);
+                result.merge_time += get_duration(merge_start_time, get_now());
+
+                const auto agreed = n_searched > 1 && count_common(previous, merged) >= agreement * k;
+                if (agreed || n_searched == n_thread) break;
+                previous.swap(merged);
+            }
+
+            unsigned long n_graph_dist_calc = 0;
+            for (int i = 0; i < n_searched; ++i) {
+                const auto& graph_result = graph_results[i];
+                result.graph_time = max(result.graph_time, graph_result.time);
+                result.n_node_access = max(result.n_node_access, graph_result.n_node_access);
+                n_graph_dist_calc = max(n_graph_dist_calc, graph_result.n_dist_calc);
+                result.n_hop = max(result.n_hop, graph_result.n_hop);
+                result.dist_from_start = max(result.dist_from_start, graph_result.dist_from_start);
+                result.incomplete |= graph_result.incomplete;
+            }
+            result.n_dist_calc += n_graph_dist_calc;
+            result.n_table = n_searched;
+            if (entry_cache) {
+                for (int i = 0; i < n_searched; ++i) entry_cache->put(cache_keys[tables[i]], merged);
+            }
+
+            result.result = move(merged);
+            restore_ids(result.result);
+            result.time = get_duration(start_time, get_now());
+
+            return result;
+        }
+
+        // fit the stop model of early_stop to searches of queries from every table
+        void train_stop_model(const Dataset<>& queries, int k, int n_start_node, int ef) {
+            vector<graph::StopFeatures> features;
+            vector<int> labels;
+            vector<int> start_ids;
+            uint64_t cache_key;
+            for (const auto& query : queries) {
+                for (int i = 0; i < n_thread; ++i) {
+                    get_start_ids(query, i, n_start_node, start_ids, cache_key);
+                    graph.collect_stop_samples(query, k, ef, start_ids, start_ids.size(),
+                                               get_n_seed(n_start_node), features, labels);
+                }
+            }
+            early_stop.model.fit(features, labels);
+        }
+
+        // search tables in parallel on the worker pool or OpenMP threads
+        template <typename F>
+        void run_tables(int n, F& search_table, bool parallel) const {
+            if (parallel && pool) pool->parallel_for(n, search_table);
+            else {
+#pragma omp parallel for num_threads(n) schedule(dynamic, 1) if(parallel)
+                for (int i = 0; i < n; ++i) search_table(i);
+            }
+        }
+
+        // throughput mode: queries run in parallel, each query searches its tables serially
+        auto batch_search(const Dataset<>& queries, int k, int n_start_node, int ef,
+                          int n_worker = n_max_threads) const {
+            auto batch_result = BatchSearchResult();
+            auto& results = batch_result.results.results;
+            results.resize(queries.size());
+
+            const auto start_time = get_now();
+#pragma omp parallel for num_threads(n_worker) schedule(dynamic, 1)
+            for (int i = 0; i < static_cast<int>(queries.size()); ++i) {
+                results[i] = knn_search_para(queries[i], k, n_start_node, ef, false);
+            }
+            const auto end_time = get_now();
+
+            batch_result.time = get_duration(start_time, end_time);
+            batch_result.qps = queries.size() * 1e6 / max<time_t>(batch_result.time, 1);
+            return batch_result;
+        }
     };
 }
 
@@ -75,6 +75,12 @@ namespace lsh {
     };
 
     struct LSHIndex {
+        // random projection of a hash function (h(o) = (a･o + b) / w)
+        struct HashParams {
+            vector<double> a;
+            double b;
+        };
+
         const int m, L;
         int dim;
         const DistanceFunction<> distance_function;
@@ -82,7 +88,9 @@ namespace lsh {
         const double w;
         Dataset<> dataset;
         vector<HashFamilyFunc> G;
+        vector<vector<HashParams>> hash_params;
         vector<HashTable> hash_tables;
+        unsigned seed;
         mt19937 engine;
 
         LSHIndex(int n_hash_func_, double w, int L,
@@ -90,9 +98,9 @@ namespace lsh {
                 m(n_hash_func_), w(w), L(L),
                 distance_type(distance), distance_function(select_distance(distance)),
                 hash_tables(vector<unordered_map<vector<int>, vector<int>, VectorHash>>(L)),
-                engine(42) {}
+                seed(42), engine(seed) {}
 
-        HashFunc create_hash_func() {
+        HashParams create_hash_params() {
             cauchy_distribution<double> cauchy_dist(0, 1);
             normal_distribution<double> norm_dist(0, 1);
             uniform_real_distribution<double> unif_dist(0, w);
@@ -108,6 +116,13 @@ namespace lsh {
             }();
 
             const auto b = unif_dist(engine);
+            return HashParams{a, b};
+        }
+
+        HashFunc make_hash_func(const HashParams& params) const {
+            const auto& a = params.a;
+            const auto b = params.b;
+            const auto w = this->w;
 
             if (distance_type == "angular") {
                 return [=](const Data<>& p) {
@@ -123,11 +138,10 @@ namespace lsh {
             }
         }
 
-        HashFamilyFunc create_hash_family() {
+        HashFamilyFunc make_hash_family(const vector<HashParams>& family_params) const {
             vector<HashFunc> hash_funcs;
-            for (int i = 0; i < m; i++) {
-                const auto h = create_hash_func();
-                hash_funcs.push_back(h);
+            for (const auto& params : family_params) {
+                hash_funcs.push_back(make_hash_func(params));
             }
 
             return [=](const Data<>& p) {
@@ -137,7 +151,14 @@ namespace lsh {
             };
         }
 
-        Data<> normalize(const Data<>& data) const {
+        HashFamilyFunc create_hash_family() {
+            vector<HashParams> family_params;
+            for (int i = 0; i < m; i++) family_params.push_back(create_hash_params());
+            hash_params.push_back(family_params);
+            return make_hash_family(family_params);
+        }
+
+        static Data<> normalize(const Data<>& data) {
             auto normalized = vector<float>(data.size(), 0);
             const auto origin = Data<>(data.id, vector<float>(data.size(), 0));
             const float norm = euclidean_distance(data, origin);
@@ -173,14 +194,27 @@ namespace lsh {
             build(in_dataset);
         }
 
-        auto find(const Data<>& query, int limit = -1) {
+        vector<int> hash_key(const Data<>& query, int table_id) const { return G[table_id](query); }
+
+        // bucket of key in table (nullptr if empty), safe for concurrent readers
+        const vector<int>* find_bucket(const vector<int>& key, int table_id) const {
+            const auto& hash_table = hash_tables[table_id];
+            const auto it = hash_table.find(key);
+            return it == hash_table.end() ? nullptr : &it->second;
+        }
+
+        const vector<int>* find_bucket(const Data<>& query, int table_id) const {
+            return find_bucket(hash_key(query, table_id), table_id);
+        }
+
+        auto find(const Data<>& query, int limit = -1) const {
             vector<int> result;
             bool is_enough = false;
 
             for (int i = 0; i < L; i++) {
-                HashTable& hash_table = hash_tables[i];
-                const auto key = G[i](query);
-                for (const auto& data_id : hash_table[key]) {
+                const auto bucket = find_bucket(query, i);
+                if (!bucket) continue;
+                for (const auto& data_id : *bucket) {
                     result.emplace_back(data_id);
                     if (limit != -1 && result.size() >= limit) {
                         is_enough = true;
@@ -0,0 +1,68 @@
+//
+//
+
+#ifndef LGTM_MIPS_HPP
+#define LGTM_MIPS_HPP
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <mylib.hpp>
+
+using namespace std;
+using namespace mylib;
+
+namespace mips {
+    float dot(const Data<>& p1, const Data<>& p2) {
+#ifdef __AVX__
+        return dot_avx(p1.x.data(), p2.x.data(), p1.size());
+#else
+        return inner_product(p1.begin(), p1.end(), p2.begin(), 0.0);
+#endif
+    }
+
+    // reduction of maximum inner product search to nearest neighbor search:
+    // data x -> (x, sqrt(M^2 - |x|^2)) and query q -> (q, 0) with M = max |x|,
+    // so |q' - x'|^2 = |q|^2 + M^2 - 2 q.x and the nearest is the maximum inner product
+    // (euclidean LSH on transformed vectors is an asymmetric LSH for inner product)
+    struct MipsTransform {
+        float max_sqr_norm = 0;   // M^2
+
+        // fit M to dataset and transform it
+        void transform_dataset(Dataset<>& dataset) {
+            vector<float> sqr_norms(dataset.size());
+#pragma omp parallel for
+            for (int i = 0; i < static_cast<int>(dataset.size()); ++i) sqr_norms[i] = dot(dataset[i], dataset[i]);
+            max_sqr_norm = dataset.empty() ? 0 : *max_element(sqr_norms.begin(), sqr_norms.end());
+
+#pragma omp parallel for
+            for (int i = 0; i < static_cast<int>(dataset.size()); ++i) {
+                dataset[i].x.emplace_back(sqrt(max(0.0f, max_sqr_norm - sqr_norms[i])));
+            }
+        }
+
+        // transform data inserted after fit. M is not refitted: a norm over M gets 0 as the
+        // appended coordinate, so the transformed norm exceeds M and the inner product is
+        // underestimated by (|x|^2 - M^2) / 2 in ranking and in score
+        void transform_data(Data<>& data) const {
+            data.x.emplace_back(sqrt(max(0.0f, max_sqr_norm - dot(data, data))));
+        }
+
+        static void transform_query(Data<>& query) { query.x.emplace_back(0); }
+
+        // replace euclidean distances of transformed query and data with negative inner products
+        void score(const Data<>& query, vector<Neighbor>& result) const {
+            const auto sqr_norm = dot(query, query);
+            for (auto& neighbor : result) {
+#ifdef __AVX__
+                const auto sqr_dist = neighbor.dist;   // squared with AVX
+#else
+                const auto sqr_dist = neighbor.dist * neighbor.dist;
+#endif
+                neighbor.dist = -(sqr_norm + max_sqr_norm - sqr_dist) / 2;
+            }
+        }
+    };
+}
+
+#endif //LGTM_MIPS_HPP
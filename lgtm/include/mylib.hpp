@@ -12,7 +12,14 @@
 #include <chrono>
 #include <exception>
 #include <stdexcept>
+#include <memory>
+#include <cstdint>
+#include <cstring>
 #include <omp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <x86intrin.h>
 #include <json.hpp>
 
@@ -133,6 +140,12 @@ namespace mylib {
         return clip(val, static_cast<float>(-1), static_cast<float>(1));
     }
 
+    // negative inner product (smaller is more similar, for maximum inner product search)
+    template <typename T = float>
+    auto inner_product_distance(const Data<T>& p1, const Data<T>& p2) {
+        return -static_cast<float>(inner_product(p1.begin(), p1.end(), p2.begin(), 0.0));
+    }
+
     constexpr float pi = static_cast<const float>(3.14159265358979323846264338);
 
     template <typename T = float>
@@ -157,6 +170,31 @@ namespace mylib {
         return _mm_load_ps (buf);
     }
 
+    // add the rest (less than 8 dims) to the sum of 8 lanes
+    static inline float l2_sqr_avx_reduce(__m256 msum1, const float *x, const float *y, size_t d) {
+        __m128 msum2 = _mm256_extractf128_ps(msum1, 1);
+        msum2 +=       _mm256_extractf128_ps(msum1, 0);
+
+        if (d >= 4) {
+            __m128 mx = _mm_loadu_ps (x); x += 4;
+            __m128 my = _mm_loadu_ps (y); y += 4;
+            const __m128 a_m_b1 = mx - my;
+            msum2 += a_m_b1 * a_m_b1;
+            d -= 4;
+        }
+
+        if (d > 0) {
+            __m128 mx = masked_read (d, x);
+            __m128 my = masked_read (d, y);
+            __m128 a_m_b1 = mx - my;
+            msum2 += a_m_b1 * a_m_b1;
+        }
+
+        msum2 = _mm_hadd_ps (msum2, msum2);
+        msum2 = _mm_hadd_ps (msum2, msum2);
+        return  _mm_cvtss_f32 (msum2);
+    }
+
     float l2_sqr_avx(const float *x, const float *y, size_t d) {
 
         __m256 msum1 = _mm256_setzero_ps();
@@ -169,22 +207,50 @@ namespace mylib {
             d -= 8;
         }
 
+        return l2_sqr_avx_reduce(msum1, x, y, d);
+    }
+
+    // l2_sqr_avx from x to 4 vectors at once (x is loaded once for them)
+    void l2_sqr_avx_x4(const float *x, const float *const *ys, size_t d, float *out) {
+        __m256 msum[4] = {_mm256_setzero_ps(), _mm256_setzero_ps(),
+                          _mm256_setzero_ps(), _mm256_setzero_ps()};
+
+        size_t i = 0;
+        for (; i + 8 <= d; i += 8) {
+            const __m256 mx = _mm256_loadu_ps (x + i);
+            for (int j = 0; j < 4; ++j) {
+                const __m256 a_m_b1 = mx - _mm256_loadu_ps (ys[j] + i);
+                msum[j] += a_m_b1 * a_m_b1;
+            }
+        }
+
+        for (int j = 0; j < 4; ++j) out[j] = l2_sqr_avx_reduce(msum[j], x + i, ys[j] + i, d - i);
+    }
+
+    float dot_avx(const float *x, const float *y, size_t d) {
+        __m256 msum1 = _mm256_setzero_ps();
+
+        while (d >= 8) {
+            __m256 mx = _mm256_loadu_ps (x); x += 8;
+            __m256 my = _mm256_loadu_ps (y); y += 8;
+            msum1 += mx * my;
+            d -= 8;
+        }
+
         __m128 msum2 = _mm256_extractf128_ps(msum1, 1);
         msum2 +=       _mm256_extractf128_ps(msum1, 0);
 
         if (d >= 4) {
             __m128 mx = _mm_loadu_ps (x); x += 4;
             __m128 my = _mm_loadu_ps (y); y += 4;
-            const __m128 a_m_b1 = mx - my;
-            msum2 += a_m_b1 * a_m_b1;
+            msum2 += mx * my;
             d -= 4;
         }
 
         if (d > 0) {
             __m128 mx = masked_read (d, x);
             __m128 my = masked_read (d, y);
-            __m128 a_m_b1 = mx - my;
-            msum2 += a_m_b1 * a_m_b1;
+            msum2 += mx * my;
         }
 
         msum2 = _mm_hadd_ps (msum2, msum2);
@@ -192,6 +258,11 @@ namespace mylib {
         return  _mm_cvtss_f32 (msum2);
     }
 
+    float inner_product_distance_avx(const Data<float>& data1,
+                                     const Data<float>& data2) {
+        return -dot_avx(&data1.x[0], &data2.x[0], data1.size());
+    }
+
     auto euclidean_distance_avx(const Data<float>& data1,
                                 const Data<float>& data2) {
         const auto dim = data1.size();
@@ -209,9 +280,49 @@ namespace mylib {
         }
         if (distance == "manhattan") return manhattan_distance<float>;
         if (distance == "angular")   return angular_distance<float>;
+        if (distance == "inner_product") {
+#ifdef __AVX__
+            return inner_product_distance_avx;
+#endif
+            return inner_product_distance<float>;
+        }
         else throw runtime_error("invalid distance");
     }
 
+    // distance functors for templated search kernels
+    // (batch: distances from query to n points at once)
+    struct EuclideanMetric {
+        // same as select_distance("euclidean")
+        float operator () (const Data<>& p1, const Data<>& p2) const {
+#ifdef __AVX__
+            return l2_sqr_avx(p1.x.data(), p2.x.data(), p1.size());
+#else
+            return euclidean_distance(p1, p2);
+#endif
+        }
+
+        void batch(const Data<>& query, const Data<>* const* points, size_t n, float* dists) const {
+            size_t i = 0;
+#ifdef __AVX__
+            for (; i + 4 <= n; i += 4) {
+                const float* ys[4] = {points[i]->x.data(), points[i + 1]->x.data(),
+                                      points[i + 2]->x.data(), points[i + 3]->x.data()};
+                l2_sqr_avx_x4(query.x.data(), ys, query.size(), dists + i);
+            }
+#endif
+            for (; i < n; ++i) dists[i] = (*this)(query, *points[i]);
+        }
+    };
+
+    struct DynamicMetric {
+        const DistanceFunction<>& calc_dist;
+        float operator () (const Data<>& p1, const Data<>& p2) const { return calc_dist(p1, p2); }
+
+        void batch(const Data<>& query, const Data<>* const* points, size_t n, float* dists) const {
+            for (size_t i = 0; i < n; ++i) dists[i] = calc_dist(query, *points[i]);
+        }
+    };
+
     template <typename T = float>
     vector<T> split(string &input, char delimiter = ',') {
         std::istringstream stream(input);
@@ -310,6 +421,207 @@ namespace mylib {
         return (path.rfind(".csv", path.size()) < path.size());
     }
 
+    bool is_bin(const string& path) {
+        return (path.rfind(".bin", path.size()) < path.size());
+    }
+
+    // read only memory mapping of a whole file
+    struct MappedFile {
+        const char* address = nullptr;
+        size_t size = 0;
+
+        MappedFile() = default;
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator = (const MappedFile&) = delete;
+        MappedFile(MappedFile&& other) noexcept { *this = move(other); }
+
+        MappedFile& operator = (MappedFile&& other) noexcept {
+            swap(address, other.address);
+            swap(size, other.size);
+            return *this;
+        }
+
+        // prefault: read the whole file into page cache when mapping
+        explicit MappedFile(const string& path, bool prefault = false) {
+            const int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) throw runtime_error("Can't open file!: " + path);
+
+            struct stat st;
+            if (fstat(fd, &st) < 0) {
+                close(fd);
+                throw runtime_error("Can't stat file!: " + path);
+            }
+            size = st.st_size;
+
+            const int flags = MAP_PRIVATE | (prefault ? MAP_POPULATE : 0);
+            void* p = size ? mmap(nullptr, size, PROT_READ, flags, fd, 0) : nullptr;
+            close(fd);
+            if (p == MAP_FAILED) throw runtime_error("Can't map file!: " + path);
+            address = static_cast<const char*>(p);
+        }
+
+        ~MappedFile() { if (address) munmap(const_cast<char*>(address), size); }
+    };
+
+    template <typename T>
+    void write_binary(ostream& os, const T* values, size_t n) {
+        os.write(reinterpret_cast<const char*>(values), n * sizeof(T));
+    }
+
+    template <typename T>
+    void write_binary(ostream& os, const T& value) { write_binary(os, &value, 1); }
+
+    // sequential reader of mapped binary file
+    struct BinaryReader {
+        const char* current;
+        const char* last;
+
+        explicit BinaryReader(const MappedFile& file) :
+                current(file.address), last(file.address + file.size) {}
+
+        template <typename T>
+        void read(T* values, size_t n) {
+            const auto n_bytes = n * sizeof(T);
+            if (current + n_bytes > last) throw runtime_error("Unexpected end of file!");
+            memcpy(values, current, n_bytes);
+            current += n_bytes;
+        }
+
+        template <typename T>
+        T read() {
+            T value;
+            read(&value, 1);
+            return value;
+        }
+
+        // skip n values and return their address in the file (may be unaligned, read with memcpy)
+        template <typename T>
+        const char* skip(size_t n) {
+            const auto n_bytes = n * sizeof(T);
+            if (current + n_bytes > last) throw runtime_error("Unexpected end of file!");
+            const auto address = current;
+            current += n_bytes;
+            return address;
+        }
+    };
+
+    // binary adjacency file:
+    // header, uint32 degree[n_node], uint32 neighbor[n_edge], (float dist[n_edge])
+    constexpr char graph_file_magic[8] = {'M', 'Y', 'G', 'R', 'A', 'P', 'H', '\0'};
+    constexpr uint32_t graph_file_version = 1;
+    constexpr uint32_t graph_file_has_dist = 1;
+    constexpr uint32_t graph_file_optimized = 2;
+
+    struct GraphFileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t flags;
+        uint64_t n_node;
+        uint64_t n_edge;
+        int64_t entry_id;   // navigating node (-1 if none)
+    };
+
+    // write adjacency lists node by node without holding them in memory
+    struct GraphWriter {
+        string path, dist_path;
+        ofstream ofs, dist_ofs;
+        GraphFileHeader header;
+        vector<uint32_t> degrees;
+
+        GraphWriter(const string& path, size_t n_node, uint32_t flags = graph_file_has_dist,
+                    int64_t entry_id = -1) : path(path), dist_path(path + ".dist"),
+                                             ofs(path, ios::binary) {
+            if (!ofs) throw runtime_error("Can't open file!: " + path);
+            copy(begin(graph_file_magic), end(graph_file_magic), header.magic);
+            header.version = graph_file_version;
+            header.flags = flags;
+            header.n_node = n_node;
+            header.n_edge = 0;
+            header.entry_id = entry_id;
+            degrees.reserve(n_node);
+
+            // neighbor ids follow the header and the degree array
+            ofs.seekp(sizeof(GraphFileHeader) + n_node * sizeof(uint32_t));
+            if (has_dist()) dist_ofs.open(dist_path, ios::binary);
+        }
+
+        bool has_dist() const { return header.flags & graph_file_has_dist; }
+
+        template <typename Iterator, typename GetId, typename GetDist>
+        void add(Iterator first, Iterator last, GetId get_id, GetDist get_dist) {
+            uint32_t degree = 0;
+            for (auto it = first; it != last; ++it, ++degree) {
+                const uint32_t id = get_id(*it);
+                ofs.write(reinterpret_cast<const char*>(&id), sizeof(id));
+                if (!has_dist()) continue;
+                const float dist = get_dist(*it);
+                dist_ofs.write(reinterpret_cast<const char*>(&dist), sizeof(dist));
+            }
+            degrees.emplace_back(degree);
+            header.n_edge += degree;
+        }
+
+        void close() {
+            if (degrees.size() != header.n_node) throw runtime_error("Invalid number of nodes!");
+
+            if (has_dist()) {
+                dist_ofs.close();
+                ifstream dist_ifs(dist_path, ios::binary);
+                ofs << dist_ifs.rdbuf();
+                dist_ifs.close();
+                remove(dist_path.c_str());
+            }
+
+            ofs.seekp(0);
+            ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            ofs.write(reinterpret_cast<const char*>(degrees.data()),
+                      degrees.size() * sizeof(uint32_t));
+            ofs.close();
+        }
+    };
+
+    // zero-copy view of binary adjacency file
+    struct MappedGraph {
+        MappedFile file;
+        const GraphFileHeader* header = nullptr;
+        const uint32_t* degrees = nullptr;
+        const uint32_t* ids = nullptr;
+        const float* dists = nullptr;
+        vector<uint64_t> offsets;
+
+        explicit MappedGraph(const string& path, bool prefault = false) : file(path, prefault) {
+            if (file.size < sizeof(GraphFileHeader))
+                throw runtime_error("Invalid graph file!: " + path);
+
+            header = reinterpret_cast<const GraphFileHeader*>(file.address);
+            if (!equal(begin(graph_file_magic), end(graph_file_magic), header->magic))
+                throw runtime_error("Invalid graph file!: " + path);
+            if (header->version != graph_file_version)
+                throw runtime_error("Unsupported graph file version!: " + path);
+
+            const auto n = header->n_node, n_edge = header->n_edge;
+            const auto dist_size = has_dist() ? n_edge * sizeof(float) : 0;
+            const auto expected_size = sizeof(GraphFileHeader) +
+                    (n + n_edge) * sizeof(uint32_t) + dist_size;
+            if (file.size != expected_size) throw runtime_error("Broken graph file!: " + path);
+
+            degrees = reinterpret_cast<const uint32_t*>(file.address + sizeof(GraphFileHeader));
+            ids = degrees + n;
+            if (has_dist()) dists = reinterpret_cast<const float*>(ids + n_edge);
+
+            offsets.resize(n + 1);
+            for (size_t i = 0; i < n; ++i) offsets[i + 1] = offsets[i] + degrees[i];
+        }
+
+        size_t size() const { return header->n_node; }
+        bool has_dist() const { return header->flags & graph_file_has_dist; }
+        bool is_optimized() const { return header->flags & graph_file_optimized; }
+        int64_t entry_id() const { return header->entry_id; }
+        uint32_t degree(size_t i) const { return degrees[i]; }
+        const uint32_t* neighbors(size_t i) const { return ids + offsets[i]; }
+        const float* distances(size_t i) const { return dists + offsets[i]; }
+    };
+
     constexpr auto double_max = numeric_limits<double>::max();
     constexpr auto double_min = numeric_limits<double>::min();
 
@@ -343,6 +655,219 @@ namespace mylib {
         }
     };
 
+    // software prefetch into all cache levels
+    void prefetch(const void* address) {
+        _mm_prefetch(static_cast<const char*>(address), _MM_HINT_T0);
+    }
+
+    // number of cache lines of a vector prefetched at most
+    constexpr size_t prefetch_max_lines = 8;
+
+    template <typename T = float>
+    void prefetch_data(const Data<T>& data) {
+        const auto base = reinterpret_cast<const char*>(data.x.data());
+        const auto n_lines = min((data.size() * sizeof(T) + 63) / 64, prefetch_max_lines);
+        for (size_t i = 0; i < n_lines; ++i) prefetch(base + i * 64);
+    }
+
+    // candidate pool sorted by distance with fixed capacity (InsertIntoPool of NSG)
+    struct CandidatePool {
+        struct Candidate : Neighbor {
+            bool checked = false;
+            Candidate(const Neighbor& neighbor) : Neighbor(neighbor) {}
+        };
+
+        size_t capacity;
+        size_t first_unchecked = 0;
+        vector<Candidate> candidates;
+
+        explicit CandidatePool(size_t capacity) : capacity(capacity) {
+            candidates.reserve(min(capacity + 1, static_cast<size_t>(1024)));
+        }
+
+        size_t size() const { return candidates.size(); }
+        bool empty() const { return candidates.empty(); }
+        auto begin() const { return candidates.begin(); }
+        auto end() const { return candidates.end(); }
+        const Candidate& operator [] (size_t i) const { return candidates[i]; }
+        const Candidate& front() const { return candidates.front(); }
+        const Candidate& back() const { return candidates.back(); }
+        bool full() const { return candidates.size() >= capacity; }
+
+        // insert neighbor and return its position (capacity if not inserted)
+        size_t insert(const Neighbor& neighbor) {
+            if (full() && neighbor.dist >= candidates.back().dist) return capacity;
+
+            const auto it = upper_bound(
+                    candidates.begin(), candidates.end(), neighbor.dist,
+                    [](float dist, const Candidate& c) { return dist < c.dist; });
+            const size_t pos = it - candidates.begin();
+            candidates.insert(it, Candidate(neighbor));
+            if (candidates.size() > capacity) candidates.pop_back();
+
+            if (pos < first_unchecked) first_unchecked = pos;
+            return pos;
+        }
+
+        // return position of the first unchecked candidate (size() if all checked)
+        size_t next_unchecked() {
+            while (first_unchecked < candidates.size() &&
+                   candidates[first_unchecked].checked) ++first_unchecked;
+            return first_unchecked;
+        }
+
+        void check(size_t i) { candidates[i].checked = true; }
+    };
+
+    // number of neighbors whose data is prefetched ahead in graph expansion loops
+    constexpr int default_prefetch_distance = 4;
+
+    // visited table with 16-bit epoch tags (reset is O(1) until the epoch wraps)
+    struct VisitedList {
+        vector<uint16_t> tags;
+        uint16_t epoch = 0;
+
+        void reset(size_t n) {
+            if (tags.size() < n) tags.resize(n, 0);
+            if (++epoch != 0) return;
+
+            // epoch wrapped around
+            fill(tags.begin(), tags.end(), 0);
+            epoch = 1;
+        }
+
+        bool contains(size_t id) const { return tags[id] == epoch; }
+
+        // return true if id is newly visited
+        bool insert(size_t id) {
+            if (tags[id] == epoch) return false;
+            tags[id] = epoch;
+            return true;
+        }
+
+        void prefetch(size_t id) const { mylib::prefetch(&tags[id]); }
+    };
+
+    constexpr uint32_t visited_hash_empty = numeric_limits<uint32_t>::max();
+
+    // open addressing hash set for a huge dataset and a tiny search budget
+    struct VisitedHashSet {
+        vector<uint32_t> slots;
+        size_t mask = 0, count = 0;
+
+        static size_t slot_of(uint32_t id, size_t mask) {
+            return (id * 0x9E3779B1u) & mask;
+        }
+
+        void reset(size_t expected) {
+            size_t capacity = 64;
+            while (capacity < expected * 2) capacity <<= 1;
+            slots.assign(capacity, visited_hash_empty);
+            mask = capacity - 1;
+            count = 0;
+        }
+
+        bool contains(size_t id) const {
+            for (auto i = slot_of(id, mask);; i = (i + 1) & mask) {
+                if (slots[i] == id) return true;
+                if (slots[i] == visited_hash_empty) return false;
+            }
+        }
+
+        bool insert(size_t id) {
+            auto i = slot_of(id, mask);
+            for (;; i = (i + 1) & mask) {
+                if (slots[i] == id) return false;
+                if (slots[i] == visited_hash_empty) break;
+            }
+            slots[i] = id;
+            if (++count * 2 > slots.size()) grow();
+            return true;
+        }
+
+        void prefetch(size_t id) const { mylib::prefetch(&slots[slot_of(id, mask)]); }
+
+        void grow() {
+            const auto old_slots = move(slots);
+            slots.assign(old_slots.size() * 2, visited_hash_empty);
+            mask = slots.size() - 1;
+            for (const auto id : old_slots) {
+                if (id == visited_hash_empty) continue;
+                auto i = slot_of(id, mask);
+                while (slots[i] != visited_hash_empty) i = (i + 1) & mask;
+                slots[i] = id;
+            }
+        }
+    };
+
+    // use hash set if n >= visited_hash_min_size and budget * visited_hash_ratio < n
+    constexpr size_t visited_hash_min_size = 1 << 24;
+    constexpr size_t visited_hash_ratio = 256;
+
+    struct VisitedTable {
+        bool hashed = false;
+        VisitedList list;
+        VisitedHashSet hash_set;
+
+        void reset(size_t n, size_t budget) {
+            hashed = n >= visited_hash_min_size &&
+                     budget > 0 && budget * visited_hash_ratio < n;
+            if (hashed) hash_set.reset(budget);
+            else list.reset(n);
+        }
+
+        bool contains(size_t id) const {
+            return hashed ? hash_set.contains(id) : list.contains(id);
+        }
+
+        bool insert(size_t id) {
+            return hashed ? hash_set.insert(id) : list.insert(id);
+        }
+
+        void prefetch(size_t id) const {
+            if (hashed) hash_set.prefetch(id);
+            else list.prefetch(id);
+        }
+    };
+
+    // thread local pool of visited tables
+    struct VisitedPool {
+        vector<unique_ptr<VisitedTable>> tables;
+
+        static VisitedPool& local() {
+            static thread_local VisitedPool pool;
+            return pool;
+        }
+
+        unique_ptr<VisitedTable> acquire() {
+            if (tables.empty()) return unique_ptr<VisitedTable>(new VisitedTable());
+            auto table = move(tables.back());
+            tables.pop_back();
+            return table;
+        }
+
+        void release(unique_ptr<VisitedTable> table) { tables.emplace_back(move(table)); }
+    };
+
+    // borrow a table from the pool of this thread and give it back on destruction
+    struct VisitedHandle {
+        unique_ptr<VisitedTable> table;
+
+        VisitedHandle(size_t n, size_t budget) : table(VisitedPool::local().acquire()) {
+            table->reset(n, budget);
+        }
+        VisitedHandle(VisitedHandle&&) = default;
+        ~VisitedHandle() { if (table) VisitedPool::local().release(move(table)); }
+
+        VisitedTable& operator * () { return *table; }
+        const VisitedTable& operator * () const { return *table; }
+        VisitedTable* operator -> () { return table.get(); }
+        const VisitedTable* operator -> () const { return table.get(); }
+    };
+
+    // budget: expected number of visited nodes (0 if unknown)
+    VisitedHandle get_visited(size_t n, size_t budget = 0) { return VisitedHandle(n, budget); }
+
     template <typename T>
     auto scan_knn_search(const Data<T>& query, int k, const Dataset<T>& dataset,
                          string distance = "euclidean") {
@@ -368,6 +893,22 @@ namespace mylib {
         return result;
     }
 
+    // all data within range of query (dist <= range), nearest first
+    template <typename T>
+    auto scan_range_search(const Data<T>& query, float range, const Dataset<T>& dataset,
+                           string distance = "euclidean") {
+        const auto df = select_distance(distance);
+
+        vector<Neighbor> result;
+        for (const auto& data : dataset) {
+            const auto dist = df(query, data);
+            if (dist <= range) result.emplace_back(dist, data.id);
+        }
+        sort(result.begin(), result.end(), CompLess());
+
+        return result;
+    }
+
     template <typename T = float>
     auto calc_centroid(const Dataset<T>& dataset) {
         const auto n = dataset.size();
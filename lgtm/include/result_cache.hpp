@@ -0,0 +1,156 @@
+//
+//
+
+#ifndef LGTM_RESULT_CACHE_HPP
+#define LGTM_RESULT_CACHE_HPP
+
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <mylib.hpp>
+
+using namespace std;
+using namespace mylib;
+
+namespace result_cache {
+    // FNV-1a
+    constexpr uint64_t fnv_offset = 14695981039346656037ull;
+    constexpr uint64_t fnv_prime = 1099511628211ull;
+
+    uint64_t hash_bytes(const void* data, size_t size, uint64_t hash = fnv_offset) {
+        const auto bytes = static_cast<const uint8_t*>(data);
+        for (size_t i = 0; i < size; ++i) {
+            hash ^= bytes[i];
+            hash *= fnv_prime;
+        }
+        return hash;
+    }
+
+    // results of recent queries, found by
+    // - exact match: hash of the query vector (the vector is compared on hit)
+    // - near duplicate: same LSH signature and within epsilon (disabled if epsilon < 0)
+    // entries are evicted in LRU order to keep the memory bound in each shard
+    struct ResultCache {
+        struct Entry {
+            Data<> query;
+            uint64_t key, signature;
+            int k;
+            vector<Neighbor> result;
+            size_t bytes;
+        };
+        using EntryList = list<Entry>;
+
+        struct Shard {
+            mutex lock;
+            EntryList entries;   // most recently used first
+            unordered_map<uint64_t, EntryList::iterator> exact_index;
+            unordered_multimap<uint64_t, EntryList::iterator> near_index;
+            size_t bytes = 0;
+        };
+
+        size_t capacity_per_shard;   // [byte]
+        float epsilon;
+        DistanceFunction<> calc_dist;
+        vector<Shard> shards;
+        atomic<unsigned long> n_exact_hit{0}, n_near_hit{0}, n_miss{0};
+
+        ResultCache(size_t capacity, float epsilon, const DistanceFunction<>& calc_dist, int n_shard = 64) :
+                capacity_per_shard(capacity / n_shard), epsilon(epsilon),
+                calc_dist(calc_dist), shards(n_shard) {}
+
+        bool near_enabled() const { return epsilon >= 0; }
+
+        // near duplicates must be in the shard of their signature
+        Shard& shard_of(uint64_t key, uint64_t signature) {
+            return shards[((near_enabled() ? signature : key) >> 32) % shards.size()];
+        }
+
+        static uint64_t make_key(const Data<>& query, uint64_t params) {
+            return hash_bytes(query.x.data(), query.size() * sizeof(float), params);
+        }
+
+        // write top-k of a cached result of query to result, return false if not cached
+        bool get(const Data<>& query, int k, uint64_t key, uint64_t signature, vector<Neighbor>& result) {
+            auto& shard = shard_of(key, signature);
+            lock_guard<mutex> guard(shard.lock);
+
+            // exact
+            const auto it = shard.exact_index.find(key);
+            if (it != shard.exact_index.end() && it->second->k >= k &&
+                memcmp(it->second->query.x.data(), query.x.data(), query.size() * sizeof(float)) == 0) {
+                hit(shard, it->second, k, result);
+                n_exact_hit.fetch_add(1, memory_order_relaxed);
+                return true;
+            }
+
+            // near duplicate
+            if (near_enabled()) {
+                const auto range = shard.near_index.equal_range(signature);
+                for (auto near_it = range.first; near_it != range.second; ++near_it) {
+                    const auto& entry = *near_it->second;
+                    if (entry.k < k || calc_dist(query, entry.query) > epsilon) continue;
+                    hit(shard, near_it->second, k, result);
+                    n_near_hit.fetch_add(1, memory_order_relaxed);
+                    return true;
+                }
+            }
+
+            n_miss.fetch_add(1, memory_order_relaxed);
+            return false;
+        }
+
+        void put(const Data<>& query, int k, uint64_t key, uint64_t signature, const vector<Neighbor>& result) {
+            const auto bytes = sizeof(Entry) + query.size() * sizeof(float) +
+                               result.size() * sizeof(Neighbor) + 64;
+            auto& shard = shard_of(key, signature);
+            if (bytes > capacity_per_shard) return;
+            lock_guard<mutex> guard(shard.lock);
+
+            // a cached result of the same query is replaced only by a longer one
+            const auto it = shard.exact_index.find(key);
+            if (it != shard.exact_index.end()) {
+                if (it->second->k >= k) return;
+                erase(shard, it->second);
+            }
+            shard.entries.push_front(Entry{query, key, signature, k, result, bytes});
+            shard.exact_index.emplace(key, shard.entries.begin());
+            if (near_enabled()) shard.near_index.emplace(signature, shard.entries.begin());
+            shard.bytes += bytes;
+
+            while (shard.bytes > capacity_per_shard) evict(shard);
+        }
+
+        unsigned long n_hit() const { return n_exact_hit + n_near_hit; }
+
+        double hit_rate() const {
+            const double n_lookup = n_hit() + n_miss;
+            return n_lookup > 0 ? n_hit() / n_lookup : 0;
+        }
+
+    private:
+        void hit(Shard& shard, EntryList::iterator it, int k, vector<Neighbor>& result) {
+            shard.entries.splice(shard.entries.begin(), shard.entries, it);
+            result.assign(it->result.begin(), it->result.begin() + min<size_t>(k, it->result.size()));
+        }
+
+        void evict(Shard& shard) { erase(shard, prev(shard.entries.end())); }
+
+        void erase(Shard& shard, EntryList::iterator it) {
+            shard.exact_index.erase(it->key);
+            const auto range = shard.near_index.equal_range(it->signature);
+            for (auto near_it = range.first; near_it != range.second; ++near_it) {
+                if (near_it->second != it) continue;
+                shard.near_index.erase(near_it);
+                break;
+            }
+            shard.bytes -= it->bytes;
+            shard.entries.erase(it);
+        }
+    };
+}
+
+#endif //LGTM_RESULT_CACHE_HPP
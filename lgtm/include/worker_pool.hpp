@@ -0,0 +1,159 @@
+//
+//
+
+#ifndef LGTM_WORKER_POOL_HPP
+#define LGTM_WORKER_POOL_HPP
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <stdexcept>
+#include <string>
+#include <pthread.h>
+#include <sched.h>
+#include <x86intrin.h>
+
+using namespace std;
+
+namespace worker_pool {
+    void pin_thread(pthread_t thread, int core) {
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        CPU_SET(core, &cpu_set);
+        if (pthread_setaffinity_np(thread, sizeof(cpu_set), &cpu_set) != 0)
+            throw runtime_error("Can't pin thread to core: " + to_string(core));
+    }
+
+    // persistent workers for short parallel loops (e.g. sub-searches of a query).
+    // a job is handed off through atomics; idle workers spin for spin_count
+    // iterations and then park on a condition variable.
+    // the calling thread runs tasks too, so n_worker + 1 tasks run at once.
+    struct WorkerPool {
+        int n_worker;
+        int spin_count;
+        vector<int> cores;   // core of each worker (not pinned if empty)
+
+        WorkerPool(int n_worker, const vector<int>& cores = {}, int spin_count = 1 << 16) :
+                n_worker(n_worker), spin_count(spin_count), cores(cores) {
+            // started workers are stopped before an error leaves the constructor
+            try {
+                for (int i = 0; i < n_worker; ++i) {
+                    workers.emplace_back([this] { work(); });
+                    if (!cores.empty()) pin_thread(workers.back().native_handle(), cores[i % cores.size()]);
+                }
+            }
+            catch (...) {
+                join();
+                throw;
+            }
+        }
+
+        WorkerPool(const WorkerPool&) = delete;
+        WorkerPool& operator=(const WorkerPool&) = delete;
+
+        ~WorkerPool() { join(); }
+
+        // keep the calling thread (and threads created by it afterwards) off the cores of workers
+        void reserve_cores() const {
+            cpu_set_t cpu_set;
+            if (pthread_getaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) != 0)
+                throw runtime_error("Can't get affinity of thread");
+            for (const auto core : cores) CPU_CLR(core, &cpu_set);
+            if (CPU_COUNT(&cpu_set) == 0) throw runtime_error("No core left for the calling thread");
+            if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) != 0)
+                throw runtime_error("Can't set affinity of thread");
+        }
+
+        // run f(0), ..., f(n_task - 1) on workers and the calling thread.
+        // a nested or concurrent call runs its tasks serially on the calling thread.
+        template <typename F>
+        void parallel_for(int n_task, F& f) {
+            if (n_task <= 1 || n_worker == 0 || busy.test_and_set(memory_order_acquire)) {
+                for (int i = 0; i < n_task; ++i) f(i);
+                return;
+            }
+
+            // publish job
+            job_call = [](void* context, int i) { (*static_cast<F*>(context))(i); };
+            job_context = &f;
+            job_n_task = n_task;
+            next_task.store(0, memory_order_relaxed);
+            n_pending.store(n_worker, memory_order_relaxed);
+            epoch.fetch_add(1, memory_order_seq_cst);
+
+            if (n_parked.load(memory_order_seq_cst) > 0) {
+                lock_guard<mutex> lock(park_mutex);
+                park_cv.notify_all();
+            }
+
+            run_tasks();
+
+            // wait until all workers leave the job
+            while (n_pending.load(memory_order_acquire) > 0) _mm_pause();
+            busy.clear(memory_order_release);
+        }
+
+    private:
+        vector<thread> workers;
+
+        // job
+        void (*job_call)(void*, int) = nullptr;
+        void* job_context = nullptr;
+        int job_n_task = 0;
+
+        atomic<uint64_t> epoch{0};
+        atomic<int> next_task{0};
+        atomic<int> n_pending{0};
+        atomic_flag busy = ATOMIC_FLAG_INIT;
+
+        // parking
+        atomic<int> n_parked{0};
+        mutex park_mutex;
+        condition_variable park_cv;
+        bool stop = false;
+
+        void join() {
+            {
+                lock_guard<mutex> lock(park_mutex);
+                stop = true;
+            }
+            park_cv.notify_all();
+            for (auto& worker : workers) worker.join();
+        }
+
+        void run_tasks() {
+            for (int i = next_task.fetch_add(1, memory_order_relaxed); i < job_n_task;
+                 i = next_task.fetch_add(1, memory_order_relaxed)) {
+                job_call(job_context, i);
+            }
+        }
+
+        void work() {
+            uint64_t seen = 0;
+            while (true) {
+                // spin, then park
+                for (int spin = 0; epoch.load(memory_order_acquire) == seen; ++spin) {
+                    if (spin < spin_count) {
+                        _mm_pause();
+                        continue;
+                    }
+
+                    unique_lock<mutex> lock(park_mutex);
+                    n_parked.fetch_add(1, memory_order_seq_cst);
+                    park_cv.wait(lock, [&] { return stop || epoch.load(memory_order_seq_cst) != seen; });
+                    n_parked.fetch_sub(1, memory_order_relaxed);
+                    if (stop) return;
+                    spin = 0;
+                }
+
+                seen = epoch.load(memory_order_acquire);
+                run_tasks();
+                n_pending.fetch_sub(1, memory_order_release);
+            }
+        }
+    };
+}
+
+#endif //LGTM_WORKER_POOL_HPP
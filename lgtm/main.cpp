@@ -1,5 +1,6 @@
 #include <mylib.hpp>
 #include <lgtm.hpp>
+#include <entry_point.hpp>
 
 using namespace std;
 using namespace mylib;
@@ -12,7 +13,7 @@ int main() {
     const string graph_path = config["graph_path"];
     const string ground_truth_path = config["groundtruth_path"];
 
-    const auto queries = load_data(query_path, n_query);
+    auto queries = load_data(query_path, n_query);
     const auto ground_truth = load_neighbors(ground_truth_path, n_query, true);
 
     // thread
@@ -25,23 +26,164 @@ int main() {
     // Graph params
     int degree = config["degree"];
 
+    // "euclidean" or "inner_product" (maximum inner product search)
+    const bool max_inner_product = config.value("distance", "euclidean") == "inner_product";
+
     // Search params
     int k = config["k"];
     int ef = config["ef"];
     int n_start_node = config["n_start_node"];
+    int prefetch_distance = config.value("prefetch_distance", default_prefetch_distance);
 
-    auto index = lgtm::LGTMIndex(m, w, t, degree);
-    index.build(data_path, graph_path, n);
+    // persistent workers for searching hash tables of a query
+    shared_ptr<worker_pool::WorkerPool> pool;
+    if (config.value("worker_pool", false)) {
+        const vector<int> worker_cores = config.value("worker_cores", vector<int>());
+        const int spin_count = config.value("spin_count", 1 << 16);
+        pool = make_shared<worker_pool::WorkerPool>(t - 1, worker_cores, spin_count);
+        if (config.value("reserve_cores", false)) pool->reserve_cores();
+    }
 
-    cout << "complete: build index" << endl;
+    // load snapshot if exists, otherwise build index (and save snapshot)
+    // the optimized graph is saved before reorder and insertion (load it as graph_path to skip graph preparation)
+    const string snapshot_path = config.value("snapshot_path", "");
+    const string optimized_graph_path = config.value("optimized_graph_path", "");
+    const bool prefault = config.value("prefault", false);
+    auto index = [&]() {
+        if (!snapshot_path.empty() && ifstream(snapshot_path)) {
+            auto index = lgtm::LGTMIndex::load(snapshot_path, prefault);
+            cout << "complete: load snapshot" << endl;
+            if (!optimized_graph_path.empty()) {
+                if (!index.original_ids.empty())
+                    throw runtime_error("optimized_graph_path can't be saved from a reordered snapshot");
+                index.graph.save(optimized_graph_path);
+            }
+            return index;
+        }
 
-    lgtm::SearchResults results;
-    for (const auto& query : queries) {
-        auto result = index.knn_search_para(query, k, n_start_node, ef);
-        result.recall = calc_recall(result.result, ground_truth[query.id], k);
-        results.push_back(move(result));
+        auto index = lgtm::LGTMIndex(m, w, t, degree);
+        index.build(data_path, graph_path, n, max_inner_product);
+        if (!optimized_graph_path.empty()) index.graph.save(optimized_graph_path);
+
+        const string reorder = config.value("reorder", "");
+        if (!reorder.empty()) index.reorder(reorder);
+
+        if (!snapshot_path.empty()) index.save(snapshot_path);
+        return index;
+    }();
+    if (max_inner_product) {
+        // search nearest neighbors of transformed queries in transformed data
+        for (auto& query : queries) mips::MipsTransform::transform_query(query);
+    }
+    index.graph.prefetch_distance = prefetch_distance;
+    index.pool = pool;
+    index.cooperative = config.value("cooperative", false);
+    index.n_adaptive_table = config.value("adaptive_table", 0);
+    index.agreement = config.value("agreement", index.agreement);
+    index.n_seed = config.value("n_seed", 1);
+    index.budget.max_time = config.value("max_time", 0);
+    index.budget.max_hop = config.value("max_hop", 0);
+    index.budget.max_dist_calc = config.value("max_dist_calc", 0);
+
+    // adaptive termination of graph search
+    index.early_stop.patience = config.value("patience", 0);
+    if (config.contains("stop_model")) {
+        const auto& stop_model = config["stop_model"];
+        index.early_stop.model.weights = stop_model["weights"].get<vector<float>>();
+        index.early_stop.model.bias = stop_model["bias"];
+        index.early_stop.model.threshold = stop_model.value("threshold", index.early_stop.model.threshold);
+    }
+    const int n_stop_train = min(config.value("train_stop_model", 0), n_query);
+    if (n_stop_train > 0) {
+        // fit the model to searches of the first queries
+        const auto train_queries = Dataset<>(queries.begin(), queries.begin() + n_stop_train);
+        index.train_stop_model(train_queries, k, n_start_node, ef);
+
+        const auto& model = index.early_stop.model;
+        cout << "stop model: weights [";
+        for (size_t i = 0; i < model.weights.size(); ++i) cout << (i ? ", " : "") << model.weights[i];
+        cout << "], bias " << model.bias << endl;
+    }
+
+    // cache of result nodes per bucket
+    const int entry_cache_size = config.value("entry_cache", 0);
+    if (entry_cache_size > 0) {
+        const int n_cached_entry = config.value("n_cached_entry", 4);
+        index.entry_cache = make_shared<entry_cache::EntryCache>(entry_cache_size, n_cached_entry);
     }
 
+    // cache of results of exact and near duplicate queries
+    const double result_cache_mb = config.value("result_cache_mb", 0.0);
+    if (result_cache_mb > 0) {
+        const float epsilon = config.value("result_cache_epsilon", -1.0);
+        index.result_cache = make_shared<result_cache::ResultCache>(
+                result_cache_mb * 1024 * 1024, epsilon, index.graph.calc_dist);
+    }
+
+    // attributes of points and filter of queries (conjunction of conditions)
+    const string attribute_path = config.value("attribute_path", "");
+    if (!attribute_path.empty()) {
+        attribute::AttributeStore attributes;
+        attributes.load(attribute_path, n);
+        index.set_attributes(move(attributes));
+    }
+    vector<attribute::Condition> conditions;
+    for (const auto& condition : config.value("filter", json::array())) {
+        const auto op = attribute::Condition::parse_op(condition.value("op", "=="));
+        const auto values = condition.contains("values") ? condition["values"].get<vector<int>>() :
+                            vector<int>{condition["value"].get<int>()};
+        conditions.push_back({index.attributes.column_id(condition["attribute"]), op, values});
+    }
+    index.brute_force_selectivity = config.value("brute_force_selectivity", index.brute_force_selectivity);
+    index.filter_start_nodes = config.value("filter_start_nodes", false);
+
+    // insert points after build (in parallel)
+    const string insert_path = config.value("insert_path", "");
+    if (!insert_path.empty()) {
+        const int n_insert = config.value("n_insert", 0);
+        const auto inserted = load_data(insert_path, n_insert);
+
+        // attributes of inserted points (same columns as attribute_path)
+        attribute::AttributeStore inserted_attributes;
+        const string insert_attribute_path = config.value("insert_attribute_path", "");
+        if (!insert_attribute_path.empty()) inserted_attributes.load(insert_attribute_path, n_insert);
+        if (inserted_attributes.names != index.attributes.names ||
+            (!index.attributes.names.empty() && inserted_attributes.size() != inserted.size()))
+            throw runtime_error("insert_attribute_path needs the attributes of attribute_path for each inserted data");
+
+        index.reserve(index.graph.size() + inserted.size());
+
+        // an exception must not leave the parallel region, the first one is rethrown after it
+        exception_ptr insert_error;
+        const auto insert_start_time = get_now();
+#pragma omp parallel for schedule(dynamic, 16)
+        for (int i = 0; i < static_cast<int>(inserted.size()); ++i) {
+            try {
+                vector<int> attribute_values;
+                for (const auto& column : inserted_attributes.columns) attribute_values.emplace_back(column[i]);
+                index.insert(inserted[i].x, n_start_node, ef, attribute_values);
+            }
+            catch (...) {
+#pragma omp critical
+                if (!insert_error) insert_error = current_exception();
+            }
+        }
+        if (insert_error) rethrow_exception(insert_error);
+        const auto insert_time = get_duration(insert_start_time, get_now());
+        cout << "insert: " << inserted.size() / (insert_time / 1e6) << " [point/s]" << endl;
+    }
+
+    // matching points are counted after insertion
+    const auto predicate = index.make_predicate(conditions);
+
+    // compressed adjacency lists
+    if (config.value("compress", false)) {
+        index.graph.compress(true);
+        cout << "compressed graph: " << index.graph.compressed.memory_size() << " [byte]" << endl;
+    }
+
+    cout << "complete: build index" << endl;
+
     const string save_postfix = "k" + to_string(k) +
                                 "-m" + to_string(m) +
                                 "w" + to_string(w) +
@@ -49,7 +191,117 @@ int main() {
                                 "t" + to_string(t) +
                                 "-start50ef" + to_string(ef) + ".csv";
     const string save_dir = config["save_dir"];
+
+    // benchmark of entry point providers (plain graph search from their start nodes)
+    if (config.contains("entry_benchmark")) {
+        const vector<string> provider_names = config["entry_benchmark"];
+        const int n_entry = config.value("n_entry", 64);
+
+        ofstream ofs(save_dir + "entry-" + save_postfix);
+        const string header = "provider,build_time,time,p99_time,dist_from_start,n_hop,n_dist_calc,recall";
+        ofs << header << endl;
+        cout << header << endl;
+
+        for (const auto& provider_name : provider_names) {
+            const auto build_start_time = get_now();
+            const auto provider = entry_point::make_entry_point_provider(
+                    provider_name, index.graph, index.lsh, n_entry);
+            const auto build_time = get_duration(build_start_time, get_now());
+
+            vector<time_t> times;
+            double dist_from_start = 0, n_hop = 0, n_dist_calc = 0, recall = 0;
+            for (const auto& query : queries) {
+                const auto start_time = get_now();
+                auto result = index.graph.knn_search(query, k, ef, *provider,
+                                                     index.get_n_seed(n_start_node));
+                times.emplace_back(get_duration(start_time, get_now()));
+
+                index.restore_ids(result.result);
+                dist_from_start += result.dist_from_start / n_query;
+                n_hop += static_cast<double>(result.n_hop) / n_query;
+                n_dist_calc += static_cast<double>(result.n_dist_calc) / n_query;
+                recall += calc_recall(result.result, ground_truth[query.id], k) / n_query;
+            }
+
+            const auto mean_time = accumulate(times.begin(), times.end(), 0.0) / n_query;
+            const auto p99 = times.begin() + times.size() * 99 / 100;
+            nth_element(times.begin(), p99, times.end());
+
+            const auto line = provider->name() + "," + to_string(build_time) + "," +
+                              to_string(mean_time) + "," + to_string(*p99) + "," +
+                              to_string(dist_from_start) + "," + to_string(n_hop) + "," +
+                              to_string(n_dist_calc) + "," + to_string(recall);
+            ofs << line << endl;
+            cout << line << endl;
+        }
+        return 0;
+    }
+
+    lgtm::SearchResults results;
+    if (!conditions.empty()) {
+        // filtered search, recall is calculated against a scan of matching points
+        cout << "filter selectivity: " << predicate.selectivity() << endl;
+        for (const auto& query : queries) {
+            auto result = index.filtered_knn_search(query, k, n_start_node, ef, predicate);
+            auto truth = index.graph.filtered_scan_knn_search(query, k, predicate).result;
+            index.restore_ids(truth);
+            result.recall = truth.empty() ? 1 : calc_recall(truth, result.result);
+            results.push_back(move(result));
+        }
+    } else if (config.value("batch", false)) {
+        // throughput mode
+        auto batch_result = index.batch_search(queries, k, n_start_node, ef);
+        cout << "qps: " << batch_result.qps << endl;
+
+        results = move(batch_result.results);
+        for (int i = 0; i < n_query; ++i) {
+            auto& result = results.results[i];
+            result.recall = calc_recall(result.result, ground_truth[queries[i].id], k);
+        }
+    } else {
+        for (const auto& query : queries) {
+            auto result = index.knn_search_para(query, k, n_start_node, ef);
+            result.recall = calc_recall(result.result, ground_truth[query.id], k);
+            results.push_back(move(result));
+        }
+    }
+    if (index.entry_cache) cout << "entry cache hit rate: " << index.entry_cache->hit_rate() << endl;
+    if (index.result_cache) {
+        const auto& cache = *index.result_cache;
+        cout << "result cache hit rate: " << cache.hit_rate()
+             << " (exact: " << cache.n_exact_hit << ", near: " << cache.n_near_hit << ")" << endl;
+    }
+
+    if (max_inner_product) {
+        for (int i = 0; i < n_query; ++i) index.mips.score(queries[i], results.results[i].result);
+    }
+
     const string log_path = save_dir + "log-" + save_postfix;
     const string result_path = save_dir + "result-" + save_postfix;
     results.save(log_path, result_path);
+
+    // range search checked against a brute force scan
+    const float range = config.value("range", 0.0);
+    if (range > 0) {
+        const float range_slack = config.value("range_slack", 0.1);
+        double recall = 0, n_result = 0, n_dist_calc = 0, time = 0;
+        for (const auto& query : queries) {
+            const auto result = index.range_search(query, range, n_start_node, ef, range_slack);
+            auto truth = scan_range_search(query, range, index.lsh.dataset, index.graph.distance_type);
+            index.restore_ids(truth);
+
+            vector<int> found;
+            for (const auto& neighbor : result.result) found.emplace_back(neighbor.id);
+            sort(found.begin(), found.end());
+            int n_found = 0;
+            for (const auto& neighbor : truth) n_found += binary_search(found.begin(), found.end(), neighbor.id);
+
+            recall += (truth.empty() ? 1.0 : static_cast<double>(n_found) / truth.size()) / n_query;
+            n_result += static_cast<double>(result.result.size()) / n_query;
+            n_dist_calc += static_cast<double>(result.n_dist_calc) / n_query;
+            time += static_cast<double>(result.time) / n_query;
+        }
+        cout << "range search: recall " << recall << ", n_result " << n_result
+             << ", n_dist_calc " << n_dist_calc << ", time " << time << endl;
+    }
 }
@@ -0,0 +1,150 @@
+#include <iostream>
+#include <mylib.hpp>
+#include <lgtm.hpp>
+
+using namespace std;
+using namespace mylib;
+
+// checks of LGTMIndex on the sample data
+// usage: test_lgtm <repository root> <directory for temporary files>
+
+int n_failure = 0;
+
+void check(bool passed, const string& name) {
+    cout << (passed ? "pass: " : "FAIL: ") << name << endl;
+    if (!passed) ++n_failure;
+}
+
+// mean recall of knn_search_para on queries against a linear scan
+double knn_recall(const lgtm::LGTMIndex& index, const Dataset<>& dataset, const Dataset<>& queries,
+                  int k, int n_start_node, int ef) {
+    double recall = 0;
+    for (const auto& query : queries) {
+        const auto result = index.knn_search_para(query, k, n_start_node, ef, false).result;
+        recall += calc_recall(result, scan_knn_search(query, k, dataset), k);
+    }
+    return recall / queries.size();
+}
+
+// mean recall of range_search on queries against a linear scan
+double range_recall(const lgtm::LGTMIndex& index, const Dataset<>& dataset, const Dataset<>& queries,
+                    float range, int n_start_node, int ef) {
+    double recall = 0;
+    for (const auto& query : queries) {
+        const auto result = index.range_search(query, range, n_start_node, ef).result;
+        const auto truth = scan_range_search(query, range, dataset);
+        if (truth.empty()) {
+            recall += 1;
+            continue;
+        }
+        vector<int> found;
+        for (const auto& neighbor : result) found.emplace_back(neighbor.id);
+        sort(found.begin(), found.end());
+        int n_found = 0;
+        for (const auto& neighbor : truth) n_found += binary_search(found.begin(), found.end(), neighbor.id);
+        recall += static_cast<double>(n_found) / truth.size();
+    }
+    return recall / queries.size();
+}
+
+bool same_results(const lgtm::LGTMIndex& index_1, const lgtm::LGTMIndex& index_2,
+                  const Dataset<>& queries, int k, int n_start_node, int ef) {
+    for (const auto& query : queries) {
+        const auto result_1 = index_1.knn_search_para(query, k, n_start_node, ef, false).result;
+        const auto result_2 = index_2.knn_search_para(query, k, n_start_node, ef, false).result;
+        if (result_1.size() != result_2.size()) return false;
+        for (size_t i = 0; i < result_1.size(); ++i) {
+            if (result_1[i].id != result_2[i].id || result_1[i].dist != result_2[i].dist) return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        cerr << "usage: test_lgtm <repository root> <directory for temporary files>" << endl;
+        return 2;
+    }
+    const string root = argv[1], tmp_dir = argv[2];
+    const string data_path = root + "/data/sift_base_sample.csv";
+    const string query_path = root + "/data/sift_query_sample.csv";
+    const string graph_path = root + "/index/aknng/sift_base_sample_d10.csv";
+    const int n = 100, n_query = 10, k = 10, n_start_node = 50, ef = 50;
+
+    const auto dataset = load_data(data_path, n);
+    const auto queries = load_data(query_path, n_query);
+
+    auto index = lgtm::LGTMIndex(3, 200, 8, 10);
+    index.build(data_path, graph_path, n);
+    check(knn_recall(index, dataset, queries, k, n_start_node, ef) == 1, "knn recall");
+
+    // range search up to radii covering both clusters of the sample (squared distances)
+    for (const float range : {1e5f, 2e5f, 4e5f}) {
+        check(range_recall(index, dataset, queries, range, n_start_node, ef) >= 0.95,
+              "range search recall (range " + to_string(static_cast<int>(range)) + ")");
+    }
+
+    // filtered search on attributes: a scan for few matches, a graph search otherwise
+    {
+        vector<int> mod, half;
+        for (int id = 0; id < n; ++id) mod.emplace_back(id % 10), half.emplace_back(id < n / 2);
+        attribute::AttributeStore attributes;
+        attributes.add_column("mod", mod);
+        attributes.add_column("half", half);
+        index.set_attributes(move(attributes));
+
+        const auto one = attribute::Predicate(index.attributes, {{0, attribute::Condition::in, {1, 3, 3}}});
+        const auto both = attribute::Predicate(index.attributes, {{0, attribute::Condition::lt, {8}},
+                                                                  {1, attribute::Condition::eq, {1}}});
+        check(one.n_match == 20 && both.n_match == 40, "predicate matches");
+
+        double scan_recall = 0, graph_recall = 0;
+        for (const auto& query : queries) {
+            const auto truth = index.graph.filtered_scan_knn_search(query, k, both).result;
+            const auto scan_result = index.filtered_knn_search(query, k, n_start_node, ef, one).result;
+            scan_recall += calc_recall(scan_result, index.graph.filtered_scan_knn_search(query, k, one).result, k);
+            vector<int> start_ids;
+            index.get_all_start_ids(query, n_start_node, start_ids);
+            const auto graph_result = index.graph.filtered_knn_search(query, k, ef, both, start_ids,
+                                                                      start_ids.size(), index.lsh.L).result;
+            graph_recall += calc_recall(graph_result, truth, k);
+        }
+        check(scan_recall / n_query == 1, "filtered scan recall");
+        check(graph_recall / n_query >= 0.9, "filtered graph search recall");
+    }
+
+    // snapshot round trip
+    const string snapshot_path = tmp_dir + "/test_snapshot.bin";
+    index.save(snapshot_path);
+    const auto loaded = lgtm::LGTMIndex::load(snapshot_path);
+    check(loaded.lsh.w == index.lsh.w && loaded.graph.distance_type == index.graph.distance_type,
+          "snapshot parameters");
+    check(same_results(index, loaded, queries, k, n_start_node, ef), "snapshot results");
+    check(loaded.lsh.engine == index.lsh.engine, "snapshot random engine");
+    remove(snapshot_path.c_str());
+
+    // optimized graph loaded as graph_path
+    const string optimized_graph_path = tmp_dir + "/test_graph.bin";
+    index.graph.save(optimized_graph_path);
+    auto rebuilt = lgtm::LGTMIndex(3, 200, 8, 10);
+    rebuilt.build(data_path, optimized_graph_path, n);
+    check(same_results(index, rebuilt, queries, k, n_start_node, ef), "optimized graph results");
+    remove(optimized_graph_path.c_str());
+
+    // reordered nodes report original ids
+    for (const string method : {"bfs", "rcm"}) {
+        auto reordered = lgtm::LGTMIndex(3, 200, 8, 10);
+        reordered.build(data_path, graph_path, n);
+        reordered.reorder(method);
+        check(knn_recall(reordered, dataset, queries, k, n_start_node, ef) == 1, "reorder " + method + " recall");
+    }
+
+    // search on compressed adjacency lists
+    auto compressed = lgtm::LGTMIndex(3, 200, 8, 10);
+    compressed.build(data_path, graph_path, n);
+    compressed.graph.compress(true);
+    check(same_results(index, compressed, queries, k, n_start_node, ef), "compressed graph results");
+
+    cout << (n_failure == 0 ? "all passed" : to_string(n_failure) + " failed") << endl;
+    return n_failure == 0 ? 0 : 1;
+}
@@ -84,6 +84,7 @@ struct Node {
 struct NSG {
     vector<Node> nodes;
     int navi_node_id;
+    int prefetch_distance = default_prefetch_distance;
 
     int m;
     int l_construct;
@@ -98,12 +99,36 @@ struct NSG {
             dist_kind(dist_kind), calc_dist(select_distance(dist_kind)),
             engine(mt19937(42)) {}
 
+    // prefetch visited tag and vector of node
+    void prefetch_node(int id, const VisitedTable& visited) const {
+        visited.prefetch(id);
+        prefetch_data(nodes[id].data);
+    }
+
     void init_nodes(const Dataset<>& series) {
         for (const auto& point : series) nodes.emplace_back(point);
     }
 
+    void load_bin(const string& graph_path) {
+        const auto graph = MappedGraph(graph_path);
+        if (graph.size() != nodes.size()) throw runtime_error("Invalid number of nodes!");
+        navi_node_id = graph.entry_id();
+
+#pragma omp parallel for schedule(dynamic, 1024)
+        for (int i = 0; i < nodes.size(); ++i) {
+            const auto ids = graph.neighbors(i);
+            for (int j = 0; j < graph.degree(i); ++j) nodes[i].add_neighbor(0, ids[j]);
+        }
+    }
+
     void load(const Dataset<>& series, const string& graph_path, int n) {
         init_nodes(series);
+        // binary
+        if (is_bin(graph_path)) {
+            load_bin(graph_path);
+            return;
+        }
+
         // csv
         if (is_csv(graph_path)) {
             ifstream ifs(graph_path);
@@ -148,13 +173,30 @@ struct NSG {
             return load_data(data_path, n);
         }();
 
-        init_nodes(series);
         load(series, graph_path, n);
     }
 
     void load_aknng(const Dataset<>& series, const string& graph_path, int n) {
         init_nodes(series);
 
+        // binary
+        if (is_bin(graph_path)) {
+            const auto graph = MappedGraph(graph_path);
+            if (graph.size() != nodes.size()) throw runtime_error("Invalid number of nodes!");
+
+#pragma omp parallel for schedule(dynamic, 1024)
+            for (int i = 0; i < nodes.size(); ++i) {
+                const auto ids = graph.neighbors(i);
+                const auto dists = graph.has_dist() ? graph.distances(i) : nullptr;
+                // graph without distances: recompute them
+                for (int j = 0; j < graph.degree(i); ++j) {
+                    const auto dist = dists ? dists[j] : calc_dist(nodes[i].data, nodes[ids[j]].data);
+                    nodes[i].add_neighbor(dist, ids[j]);
+                }
+            }
+            return;
+        }
+
         // csv file
         if (is_csv(graph_path)) {
             ifstream ifs(graph_path);
@@ -194,10 +236,22 @@ struct NSG {
 
     void load_aknng(const string& data_path, const string& graph_path, int n) {
         auto series = load_data(data_path, n);
-        load(series, graph_path, n);
+        load_aknng(series, graph_path, n);
     }
 
     void save(const string& save_dir) {
+        // binary
+        if (is_bin(save_dir)) {
+            auto writer = GraphWriter(save_dir, nodes.size(), 0, navi_node_id);
+            for (const auto& node : nodes) {
+                writer.add(node.neighbors.begin(), node.neighbors.end(),
+                           [](const Neighbor& n) { return n.id; },
+                           [](const Neighbor& n) { return n.dist; });
+            }
+            writer.close();
+            return;
+        }
+
         const string navi_node_path = save_dir + "/navi-node.csv";
         ofstream navi_node_ofs(navi_node_path);
         // write navigating node
@@ -224,51 +278,51 @@ struct NSG {
         auto result = SearchResult();
         const auto start_time = get_now();
 
-        vector<bool> checked(nodes.size()), added(nodes.size());
-        added[navi_node_id];
+        auto added = get_visited(nodes.size(), l * m);
+        added->insert(navi_node_id);
 
-        vector<Neighbor> candidates;
+        CandidatePool candidates(l);
         const auto& navi_node = nodes[navi_node_id];
         const auto dist_from_navi = calc_dist(query, navi_node.data);
-        candidates.emplace_back(dist_from_navi, navi_node_id);
+        candidates.insert(Neighbor(dist_from_navi, navi_node_id));
 
         result.dist_from_navi = dist_from_navi;
 
         while (true) {
             // find the first unchecked node
-            int first_unchecked_index = 0;
-            for (const auto candidate : candidates) {
-                if (!checked[candidate.id]) break;
-                ++first_unchecked_index;
-            }
+            const auto first_unchecked_index = candidates.next_unchecked();
 
             // checked all candidates
-            if (first_unchecked_index >= l) break;
+            if (first_unchecked_index >= candidates.size()) break;
 
             ++result.n_hop;
 
             const auto first_unchecked_node_id = candidates[first_unchecked_index].id;
-            checked[first_unchecked_node_id] = true;
+            candidates.check(first_unchecked_index);
             const auto& first_unchecked_node = nodes[first_unchecked_node_id];
 
-            for (const auto& neighbor : first_unchecked_node.neighbors) {
+            const auto& neighbors = first_unchecked_node.neighbors;
+            for (int i = 0; i < min(prefetch_distance, (int)neighbors.size()); ++i) {
+                prefetch_node(neighbors[i].id, *added);
+            }
+
+            for (int i = 0; i < neighbors.size(); ++i) {
+                const auto& neighbor = neighbors[i];
+                if (i + prefetch_distance < neighbors.size()) {
+                    prefetch_node(neighbors[i + prefetch_distance].id, *added);
+                }
+
                 result.n_node_access++;
 
-                if (added[neighbor.id]) continue;
-                added[neighbor.id] = true;
+                if (!added->insert(neighbor.id)) continue;
 
                 result.n_dist_calc++;
 
                 const auto& neighbor_node = nodes[neighbor.id];
                 const auto dist = calc_dist(query, neighbor_node.data);
-                candidates.emplace_back(dist, neighbor.id);
+                candidates.insert(Neighbor(dist, neighbor.id));
                 result.all_candidates.emplace_back(dist, neighbor.id);
             }
-
-            // sort and resize candidates l
-            sort(candidates.begin(), candidates.end(),
-                 [](const auto& n1, const auto& n2) { return n1.dist < n2.dist; });
-            if (candidates.size() > l) candidates.resize(l);
         }
 
         for (const auto& c : candidates) {
@@ -285,13 +339,12 @@ struct NSG {
     auto calc_neighbor_candidates(const Node& query_node) {
         Neighbors result;
 
-        vector<bool> added(nodes.size());
-        added[query_node.id] = true;
+        auto added = get_visited(nodes.size(), query_node.neighbors.size() + c_construct);
+        added->insert(query_node.id);
 
         // add query_node's neighbors
         for (const auto& neighbor : query_node.neighbors) {
-            if (added[neighbor.id]) continue;
-            added[neighbor.id] = true;
+            if (!added->insert(neighbor.id)) continue;
             result.emplace_back(neighbor);
         }
 
@@ -302,8 +355,7 @@ struct NSG {
         if (all_candidates.size() > c_construct) all_candidates.resize(c_construct);
 
         for (const auto& candidate : all_candidates) {
-            if (added[candidate.id]) continue;
-            added[candidate.id] = true;
+            if (!added->insert(candidate.id)) continue;
             result.emplace_back(candidate);
         }
 
@@ -21,8 +21,22 @@ int main() {
     int k = config["k"];
     int l = config["l"];
 
+    // load NSG if index_path exists, otherwise build it (and save it to index_path)
     auto index = NSG(m);
-    index.build(data_path, graph_path, n);
+    const string index_path = config.value("index_path", "");
+    const auto index_exists = [&]() {
+        if (index_path.empty()) return false;
+        if (is_bin(index_path)) return static_cast<bool>(ifstream(index_path));
+        return static_cast<bool>(ifstream(index_path + "/navi-node.csv"));
+    }();
+    if (index_exists) {
+        index.load(data_path, index_path, n);
+        cout << "complete: load index" << endl;
+    }
+    else {
+        index.build(data_path, graph_path, n);
+        if (!index_path.empty()) index.save(index_path);
+    }
 
     cout << "complete: build index" << endl;
 
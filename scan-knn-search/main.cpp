@@ -39,12 +39,15 @@ struct SearchResults {
     }
 };
 
-SearchResult knn_search(const Data<>& query, const int k, const Dataset<>& series) {
+// max_inner_product: distance is negative inner product (maximum inner product search)
+SearchResult knn_search(const Data<>& query, const int k, const Dataset<>& series, bool max_inner_product) {
     auto result = SearchResult();
     const auto start_time = get_now();
 
     for (const auto& data : series) {
-        const auto dist = euclidean_distance(query, data);
+        const auto dist = max_inner_product ?
+                          -inner_product(query.x.begin(), query.x.end(), data.x.begin(), 0.0f) :
+                          euclidean_distance(query, data);
         result.result.emplace(dist, data.id);
         if (result.result.size() > k)
             result.result.erase(--result.result.cend());
@@ -65,6 +68,8 @@ int main() {
     const string query_path = config["query_path"];
     const auto queryset = load_data(query_path, n_query);
 
+    const bool max_inner_product = config.value("distance", "euclidean") == "inner_product";
+
     const string save_dir = config["save_dir"];
     const string log_path = save_dir + "log.csv", result_path = save_dir + "result.csv";
 
@@ -74,7 +79,7 @@ int main() {
 #pragma omp parallel for
     for (int i = 0; i < queryset.size(); i++) {
         const auto& query = queryset[i];
-        results.results[i] = knn_search(query, k, dataset);
+        results.results[i] = knn_search(query, k, dataset, max_inner_product);
     }
 
     results.save(log_path, result_path);